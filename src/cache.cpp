@@ -0,0 +1,113 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+ContentCache::ContentCache(size_t capacity) : capacity(capacity), bytes(0), hits(0), misses(0), evictions(0) {}
+
+std::shared_ptr<const Blob> ContentCache::load(const std::filesystem::path& source) {
+	int fd = open(source.c_str(), O_RDONLY);
+	if (fd == -1) {
+		return nullptr;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return nullptr;
+	}
+
+	// Sparse files would be inflated, huge ones would flush everything else.
+	bool sparse = (size_t) st.st_size > MMAP_THRESHOLD && st.st_blocks * 512 < st.st_size;
+	if (sparse || (size_t) st.st_size > this->capacity / 4) {
+		close(fd);
+		return nullptr;
+	}
+
+	auto blob = std::make_shared<Blob>();
+
+	blob->size = st.st_size;
+	if (blob->size <= MMAP_THRESHOLD) {
+		blob->owned.resize(blob->size);
+		size_t got = 0;
+		while (got < blob->size) {
+			ssize_t res = pread(fd, blob->owned.data() + got, blob->size - got, got);
+			if (res <= 0) {
+				close(fd);
+				return nullptr;
+			}
+			got += res;
+		}
+		blob->data = blob->owned.data();
+	} else {
+		blob->mapping = mmap(nullptr, blob->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (blob->mapping == MAP_FAILED) {
+			blob->mapping = nullptr;
+			close(fd);
+			return nullptr;
+		}
+		madvise(blob->mapping, blob->size, MADV_SEQUENTIAL);
+		blob->data = (const char*) blob->mapping;
+	}
+
+	close(fd);
+	return blob;
+}
+
+void ContentCache::evict() {
+	while (this->bytes > this->capacity && !this->lru.empty()) {
+		Entry& entry = this->lru.back();
+		this->bytes -= entry.content->size;
+		this->index.erase(entry.filepath);
+		this->lru.pop_back();
+		this->evictions++;
+	}
+}
+
+std::shared_ptr<const Blob> ContentCache::get(const std::string& filepath, uint64_t version, const std::filesystem::path& source) {
+	auto it = this->index.find(filepath);
+	if (it != this->index.end()) {
+		if (it->second->version == version) {
+			this->hits++;
+			this->lru.splice(this->lru.begin(), this->lru, it->second);
+			return it->second->content;
+		}
+
+		this->bytes -= it->second->content->size;
+		this->lru.erase(it->second);
+		this->index.erase(it);
+	}
+
+	this->misses++;
+	std::shared_ptr<const Blob> content = this->load(source);
+	if (content) {
+		this->lru.push_front({filepath, version, content});
+		this->index[filepath] = this->lru.begin();
+		this->bytes += content->size;
+		this->evict();
+	}
+	return content;
+}
+
+void ContentCache::erase(const std::string& filepath) {
+	for (auto it = this->lru.begin(); it != this->lru.end();) {
+		if (PathWithin(it->filepath, filepath)) {
+			this->bytes -= it->content->size;
+			this->index.erase(it->filepath);
+			it = this->lru.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void ContentCache::report(std::ostream& out) const {
+	uint64_t lookups = this->hits + this->misses;
+	out << "Cache: " << this->lru.size() << " entries, "
+		<< this->bytes << "/" << this->capacity << " bytes, "
+		<< this->hits << " hits, " << this->misses << " misses ("
+		<< (lookups ? 100 * this->hits / lookups : 0) << "% hit rate), "
+		<< this->evictions << " evictions" << std::endl;
+}
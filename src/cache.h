@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include "transfer.h"
+
+// Files up to this size are copied into memory, larger ones are mapped.
+constexpr size_t MMAP_THRESHOLD = 256 * 1024;
+
+// Size-bounded LRU of recently published file contents, keyed by path and
+// version so a replaced file is never served stale. Sized with SYNC_CACHE_MB.
+class ContentCache {
+	struct Entry {
+		std::string filepath;
+		uint64_t version;
+		std::shared_ptr<const Blob> content;
+	};
+
+	std::list<Entry> lru;
+	std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+	std::shared_ptr<const Blob> load(const std::filesystem::path& source);
+	void evict();
+
+public:
+	size_t capacity;
+	size_t bytes;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+
+	ContentCache(size_t capacity);
+	// Returns nullptr for files that aren't worth caching, e.g. sparse ones.
+	std::shared_ptr<const Blob> get(const std::string& filepath, uint64_t version, const std::filesystem::path& source);
+	// Drops filepath and everything below it.
+	void erase(const std::string& filepath);
+	void report(std::ostream& out) const;
+};
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <csignal>
 #include <cstdlib>
 #include <deque>
 #include <fcntl.h>
@@ -7,18 +8,26 @@
 #include <format>
 #include <iostream>
 #include <iterator>
+#include <list>
+#include <set>
 #include <sstream>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <sys/fanotify.h>
 #include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 #include "lib.h"
 
+volatile sig_atomic_t stopping = 0;
+
 class Server : public Socket {
 public:
 	Server(int fd) : Socket(fd) {}
 	std::deque<std::string> lastSentFromServer;
 	void handle(std::vector<char> buf) override;
+	void handleChunk(uint32_t stream, const char* buf, ssize_t len) override;
 };
 
 
@@ -27,34 +36,32 @@ class Client : public SyncDir {
 public:
 	Client(fs::path base, fs::path conflict) : SyncDir(base), conflict(conflict) {}
 
-	void updateFileConflictHook(std::string filepath, ssize_t mtime, ssize_t len, Socket* source) override {
-		std::ostringstream oss;
-		oss << "eConflict detected on " << filepath << "\n\n";
-		source->sendData(oss.str());
-		
-		fs::path realFilepath = this-> conflict / std::format("{}-{:#018x}", filepath, mtime); 
-		if (fs::exists(realFilepath)) {
-			std::cerr << "Failed to save conflict \"" << filepath << "\"" << std::endl;
+	// Creates a sparse placeholder for a file announced with "i", returns
+	// whether it was published.
+	bool placeholder(std::string filepath, ssize_t mtime, ssize_t len, std::string version, Socket* source);
+	void updateFilePostHook(std::string filepath, ssize_t mtime, ssize_t len, Socket* source) override;
+	void moveFilePostHook(std::string oldFilepath, std::string newFilepath, Socket* source) override;
+	void deleteFilePostHook(std::string filepath, bool isDir, Socket* source, uintmax_t count) override;
+	void reloadIgnorePostHook() override;
+
+	// The server's version wins, the local one is kept in the conflict
+	// directory. Published files are replaced rather than written in place,
+	// so a hard link preserves the local contents without copying them.
+	bool updateFileConflictHook(std::string filepath, [[maybe_unused]] ssize_t _1, [[maybe_unused]] ssize_t _2, [[maybe_unused]] Socket* _3) override {
+		fs::path local = this->base / filepath;
+		ssize_t mtime = fs::last_write_time(local).time_since_epoch().count();
+		fs::path realFilepath = this->conflict / std::format("{}-{:#018x}", filepath, mtime);
+		CreateDirectoryRecursive(realFilepath.parent_path().string());
+		// A placeholder has no local contents, and opening it would wait on
+		// this thread.
+		if (getxattr(local.c_str(), PLACEHOLDER_XATTR, nullptr, 0) != -1) {
+			return true;
 		}
-		
-		std::ofstream file(realFilepath, std::ios::out | std::ios::trunc | std::ios::binary);
-		if (!file.is_open()) {
+		if (link(local.c_str(), realFilepath.c_str()) == -1 && !this->copyFile(local, realFilepath)) {
 			std::cerr << "Failed to save conflict \"" << filepath << "\"" << std::endl;
 		}
-		
-		std::vector<char> buf; // (len);
-		for (ssize_t j = 0; j < len; ++j){
-			buf.push_back(0);
-		}
-		ssize_t i = 0;
-		while (i < len) {
-			ssize_t rlen = source->readData(buf.data() + i, len - 1);
-			if (rlen > 0) {
-				file.write(buf.data() + i, rlen);
-				i += rlen;
-			}
-		}
-		file.close();
+
+		return true;
 	}
 };
 
@@ -76,10 +83,490 @@ template<typename T> T try_or_exit(T result, std::string message) {
 	return result;
 }
 
+static bool LazyFromEnv() {
+	const char* env = getenv("SYNC_LAZY");
+	return env && atoi(env);
+}
+
+static size_t LazyBudgetFromEnv() {
+	const char* env = getenv("SYNC_LAZY_CACHE_MB");
+	return (size_t) (env ? atoi(env) : 1024) << 20;
+}
+
+static ssize_t MTime(const struct stat& st) {
+	return st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// Fills in placeholders, sparse files of the right size without contents, the
+// first time they are opened. Opens are held with fanotify permission events
+// while the contents are fetched in ranges and written through the event fd,
+// which raises no events of its own. Hydrated files are kept within a disk
+// budget, the least recently opened ones are turned back into placeholders.
+class Hydrator {
+	struct Placeholder {
+		ssize_t len;
+		// Version of the contents on the server.
+		std::string version;
+		// Next offset to ask for, ranges asked for and ranges arriving.
+		ssize_t next;
+		std::set<ssize_t> requested;
+		int receiving;
+		// Event fds of the held opens, the contents are written through the first.
+		std::vector<int> waiters;
+		// An O_PATH descriptor, which opening isn't reported for, to find the
+		// mark by once the name points elsewhere.
+		int anchor;
+	};
+
+	struct Fetch {
+		std::string filepath;
+		ssize_t offset;
+		ssize_t remaining;
+	};
+
+	struct Hydrated {
+		std::string filepath;
+		ssize_t len;
+		// Nanoseconds, a file written since isn't evicted.
+		ssize_t mtime;
+		std::string version;
+	};
+
+	std::string root;
+	std::unordered_map<std::string, Placeholder> placeholders;
+	std::unordered_map<uint32_t, Fetch> fetches;
+	// Most recently opened first.
+	std::list<Hydrated> lru;
+	std::unordered_map<std::string, std::list<Hydrated>::iterator> hydrated;
+	size_t bytes;
+	size_t budget;
+
+	void respond(int eventFd, uint32_t response) {
+		fanotify_response answer{eventFd, response};
+		if (write(this->fd, &answer, sizeof(answer)) == -1) {
+			perror("fanotify response");
+		}
+		close(eventFd);
+	}
+
+	// Asks for up to FETCH_DEPTH ranges at a time, completes the file once
+	// all of them are in.
+	void request(std::string filepath, Placeholder& placeholder) {
+		while (placeholder.next < placeholder.len && (int) placeholder.requested.size() + placeholder.receiving < FETCH_DEPTH) {
+			ssize_t len = std::min(FETCH_RANGE, placeholder.len - placeholder.next);
+			std::ostringstream oss;
+			oss << "r" << filepath << "\n" << placeholder.next << ' ' << len << "\n\n";
+			this->server->send(oss.str(), {filepath});
+			placeholder.requested.insert(placeholder.next);
+			placeholder.next += len;
+		}
+
+		if (placeholder.next >= placeholder.len && placeholder.requested.empty() && placeholder.receiving == 0) {
+			this->complete(filepath);
+		}
+	}
+
+	// Stops fetching filepath, its held opens fail and are retried by the reader.
+	void fail(std::string filepath) {
+		Placeholder& placeholder = this->placeholders.at(filepath);
+		for (int waiter : placeholder.waiters) {
+			this->respond(waiter, FAN_DENY);
+		}
+		placeholder.waiters.clear();
+		placeholder.requested.clear();
+		placeholder.receiving = 0;
+		placeholder.next = 0;
+
+		std::erase_if(this->fetches, [&](auto const& entry) {
+			if (entry.second.filepath != filepath) {
+				return false;
+			}
+			this->server->cancelIncoming(entry.first);
+			return true;
+		});
+	}
+
+	// Lets opens of a placeholder through again, leaving it as it is.
+	void release(std::string filepath) {
+		this->fail(filepath);
+		Placeholder& placeholder = this->placeholders.at(filepath);
+		std::string proc = "/proc/self/fd/" + std::to_string(placeholder.anchor);
+		removexattr(proc.c_str(), PLACEHOLDER_XATTR);
+		fanotify_mark(this->fd, FAN_MARK_REMOVE, FAN_OPEN_PERM, AT_FDCWD, proc.c_str());
+		close(placeholder.anchor);
+		this->placeholders.erase(filepath);
+	}
+
+	void complete(std::string filepath) {
+		Placeholder placeholder = std::move(this->placeholders.at(filepath));
+		this->placeholders.erase(filepath);
+		close(placeholder.anchor);
+
+		int eventFd = placeholder.waiters.front();
+		struct stat st;
+		fstat(eventFd, &st);
+		fremovexattr(eventFd, PLACEHOLDER_XATTR);
+		fsetxattr(eventFd, HYDRATED_XATTR, placeholder.version.data(), placeholder.version.size(), 0);
+		// Opens are only watched from now on, to keep the LRU order.
+		fanotify_mark(this->fd, FAN_MARK_REMOVE, FAN_OPEN_PERM, eventFd, nullptr);
+		fanotify_mark(this->fd, FAN_MARK_ADD, FAN_OPEN, eventFd, nullptr);
+		client.commit.enqueue(dup(eventFd), (client.base / filepath).parent_path());
+
+		for (int waiter : placeholder.waiters) {
+			this->respond(waiter, FAN_ALLOW);
+		}
+		std::cout << "[HY] Hydrated: " << filepath << std::endl;
+
+		this->lru.push_front({filepath, placeholder.len, MTime(st), placeholder.version});
+		this->hydrated[filepath] = this->lru.begin();
+		this->bytes += placeholder.len;
+		this->evict();
+	}
+
+	void open(int eventFd, std::string filepath) {
+		auto it = this->placeholders.find(filepath);
+		if (it == this->placeholders.end()) {
+			this->respond(eventFd, FAN_ALLOW);
+			return;
+		}
+
+		it->second.waiters.push_back(eventFd);
+		if (it->second.waiters.size() == 1) {
+			std::cout << "[HY] Fetching: " << filepath << std::endl;
+			this->request(filepath, it->second);
+		}
+	}
+
+	void touch(std::string filepath) {
+		auto it = this->hydrated.find(filepath);
+		if (it != this->hydrated.end()) {
+			this->lru.splice(this->lru.begin(), this->lru, it->second);
+		}
+	}
+
+	std::optional<std::string> pathOf(int eventFd) {
+		char buf[BUFFER_SIZE];
+		fs::path link = fs::path("/proc/self/fd") / std::to_string(eventFd);
+		ssize_t len = readlink(link.c_str(), buf, sizeof(buf));
+		if (len == -1) {
+			return std::nullopt;
+		}
+
+		std::string path(buf, len);
+		if (!PathWithin(path, this->root) || path.size() == this->root.size()) {
+			return std::nullopt;
+		}
+		return path.substr(this->root.size() + 1);
+	}
+
+public:
+	int fd;
+	Server* server;
+	std::string base;
+
+	Hydrator(std::string path, Server* server) : bytes(0), budget(LazyBudgetFromEnv()), server(server), base(path) {
+		this->root = fs::canonical(path).string();
+		this->fd = fanotify_init(FAN_CLASS_CONTENT | FAN_CLOEXEC | FAN_NONBLOCK, O_RDWR | O_LARGEFILE | O_CLOEXEC);
+		if (this->fd == -1) {
+			perror("fanotify_init");
+			return;
+		}
+
+		// Placeholders are only safe where they can be told apart after a restart.
+		if (setxattr(this->root.c_str(), PLACEHOLDER_XATTR, "", 0, 0) == -1) {
+			perror("setxattr");
+			close(this->fd);
+			this->fd = -1;
+			return;
+		}
+		removexattr(this->root.c_str(), PLACEHOLDER_XATTR);
+	}
+
+	~Hydrator() {
+		if (this->fd != -1) {
+			// Closing the group lets every held open through.
+			close(this->fd);
+		}
+	}
+
+	// Picks up the placeholders and hydrated files of an earlier run.
+	void scan() {
+		std::error_code ec;
+		for (auto it = fs::recursive_directory_iterator(this->base, ec); it != fs::recursive_directory_iterator(); it.increment(ec)) {
+			if (!it->is_regular_file()) {
+				continue;
+			}
+
+			std::string filepath = it->path().string().substr(this->base.length() + 1);
+			ssize_t len = it->file_size();
+			char buf[BUFFER_SIZE];
+			ssize_t size = getxattr(it->path().c_str(), PLACEHOLDER_XATTR, buf, sizeof(buf));
+			if (size != -1) {
+				int anchor = ::open(it->path().c_str(), O_PATH | O_CLOEXEC);
+				if (anchor != -1 && fanotify_mark(this->fd, FAN_MARK_ADD, FAN_OPEN_PERM, AT_FDCWD, it->path().c_str()) != -1) {
+					this->placeholders[filepath] = Placeholder{len, std::string(buf, size), 0, {}, 0, {}, anchor};
+				} else if (anchor != -1) {
+					close(anchor);
+				}
+				continue;
+			}
+
+			struct stat st;
+			size = getxattr(it->path().c_str(), HYDRATED_XATTR, buf, sizeof(buf));
+			if (size != -1 && stat(it->path().c_str(), &st) != -1
+				&& fanotify_mark(this->fd, FAN_MARK_ADD, FAN_OPEN, AT_FDCWD, it->path().c_str()) != -1) {
+				this->lru.push_back({filepath, len, MTime(st), std::string(buf, size)});
+				this->hydrated[filepath] = std::prev(this->lru.end());
+				this->bytes += len;
+			}
+		}
+
+		this->evict();
+	}
+
+	// Publishes placeholders in place of the least recently opened files that
+	// are neither open nor changed since they were hydrated. A write lease is
+	// only granted while nobody else has the file open, and holding it makes
+	// new opens wait until the placeholder is in place. Files passed over are
+	// tried again on the next call.
+	void evict() {
+		auto it = this->lru.end();
+		while (this->bytes > this->budget && this->lru.size() > 1 && std::prev(it) != this->lru.begin()) {
+			--it;
+			fs::path target = client.base / it->filepath;
+			int fd = ::open(target.c_str(), O_RDONLY | O_CLOEXEC);
+			struct stat st;
+			if (fd == -1 || fcntl(fd, F_SETLEASE, F_WRLCK) == -1 || fstat(fd, &st) == -1
+				|| st.st_size != it->len || MTime(st) != it->mtime) {
+				if (fd != -1) {
+					close(fd);
+				}
+				continue;
+			}
+
+			Hydrated victim = *it;
+			it = this->lru.erase(it);
+			this->hydrated.erase(victim.filepath);
+			this->bytes -= victim.len;
+
+			StagedFile file(target.parent_path());
+			if (file.fd == -1 || ftruncate(file.fd, victim.len) == -1
+				|| !this->prepare(file.fd, victim.filepath, victim.len, victim.version)
+				|| !file.publish(target, client.commit)) {
+				std::cerr << "Failed to evict \"" << victim.filepath << "\"." << std::endl;
+				this->forget(victim.filepath);
+				close(fd);
+				continue;
+			}
+			// Closing releases the lease.
+			close(fd);
+			this->server->lastSentFromServer.push_front("u" + this->base + "/" + victim.filepath);
+			std::cout << "[HY] Evicted: " << victim.filepath << std::endl;
+		}
+	}
+
+	// Registers the staged contents of a placeholder before they are published,
+	// so no open can slip in between.
+	bool prepare(int stagedFd, std::string filepath, ssize_t len, std::string version) {
+		this->forget(filepath);
+		std::string proc = "/proc/self/fd/" + std::to_string(stagedFd);
+		int anchor = ::open(proc.c_str(), O_PATH | O_CLOEXEC);
+		if (anchor == -1) {
+			return false;
+		}
+		if (fsetxattr(stagedFd, PLACEHOLDER_XATTR, version.data(), version.size(), 0) == -1
+			|| fanotify_mark(this->fd, FAN_MARK_ADD, FAN_OPEN_PERM, stagedFd, nullptr) == -1) {
+			close(anchor);
+			return false;
+		}
+
+		this->placeholders[filepath] = Placeholder{len, version, 0, {}, 0, {}, anchor};
+		return true;
+	}
+
+	// Whether filepath still waits for its contents, only the owner of the
+	// fanotify group can't open it.
+	bool isPlaceholder(std::string filepath) {
+		return this->placeholders.contains(filepath);
+	}
+
+	void handle() {
+		char buf[BUFFER_SIZE] __attribute__((aligned(alignof(fanotify_event_metadata))));
+		while (true) {
+			ssize_t len = read(this->fd, buf, sizeof(buf));
+			if (len == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno != EAGAIN) {
+					try_or_exit(len, "read");
+				}
+				return;
+			}
+
+			for (auto event = (fanotify_event_metadata*) buf; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+				if (event->fd < 0) {
+					continue;
+				}
+
+				std::optional<std::string> filepath = this->pathOf(event->fd);
+				if (event->mask & FAN_OPEN_PERM) {
+					if (filepath) {
+						this->open(event->fd, *filepath);
+					} else {
+						this->respond(event->fd, FAN_ALLOW);
+					}
+					continue;
+				}
+
+				if (filepath) {
+					this->touch(*filepath);
+				}
+				close(event->fd);
+			}
+		}
+	}
+
+	// Starts a range announced by a "g" header, unless it is no longer wanted.
+	void receive(std::string filepath, ssize_t offset, ssize_t len, uint32_t stream, std::string version) {
+		auto it = this->placeholders.find(filepath);
+		if (it == this->placeholders.end() || it->second.requested.erase(offset) == 0) {
+			if (len > 0) {
+				this->server->cancelIncoming(stream);
+			}
+			return;
+		}
+
+		if (version != it->second.version) {
+			// A newer version is on its way as another placeholder.
+			if (len > 0) {
+				this->server->cancelIncoming(stream);
+			}
+			this->fail(filepath);
+			return;
+		}
+
+		if (len == 0) {
+			this->request(filepath, it->second);
+			return;
+		}
+		this->fetches[stream] = Fetch{filepath, offset, len};
+		it->second.receiving++;
+	}
+
+	// Returns false for streams that aren't fetching a placeholder,
+	// buf is nullptr for a hole.
+	bool append(uint32_t stream, const char* buf, ssize_t len) {
+		auto it = this->fetches.find(stream);
+		if (it == this->fetches.end()) {
+			return false;
+		}
+
+		Fetch& fetch = it->second;
+		Placeholder& placeholder = this->placeholders.at(fetch.filepath);
+		for (ssize_t written = 0; buf && written < len;) {
+			ssize_t res = pwrite(placeholder.waiters.front(), buf + written, len - written, fetch.offset + written);
+			if (res == -1 && errno == EINTR) {
+				continue;
+			}
+			if (res == -1) {
+				std::cerr << "Failed to hydrate \"" << fetch.filepath << "\"." << std::endl;
+				this->fail(fetch.filepath);
+				return true;
+			}
+			written += res;
+		}
+
+		fetch.offset += len;
+		fetch.remaining -= len;
+		if (fetch.remaining <= 0) {
+			std::string filepath = fetch.filepath;
+			this->fetches.erase(it);
+			placeholder.receiving--;
+			this->request(filepath, placeholder);
+		}
+		return true;
+	}
+
+	// Returns false for streams that aren't fetching a placeholder.
+	bool abort(uint32_t stream) {
+		auto it = this->fetches.find(stream);
+		if (it == this->fetches.end()) {
+			return false;
+		}
+
+		this->fail(it->second.filepath);
+		return true;
+	}
+
+	// Stops treating filepath and everything below it specially, e.g. once it
+	// is replaced or changed locally.
+	void forget(std::string filepath) {
+		std::vector<std::string> stale;
+		for (auto const &[key, _] : this->placeholders) {
+			if (PathWithin(key, filepath)) {
+				stale.push_back(key);
+			}
+		}
+		for (auto const& key : stale) {
+			this->release(key);
+		}
+
+		for (auto it = this->lru.begin(); it != this->lru.end();) {
+			if (!PathWithin(it->filepath, filepath)) {
+				++it;
+				continue;
+			}
+
+			fs::path path = client.base / it->filepath;
+			removexattr(path.c_str(), HYDRATED_XATTR);
+			fanotify_mark(this->fd, FAN_MARK_REMOVE, FAN_OPEN, AT_FDCWD, path.c_str());
+			this->bytes -= it->len;
+			this->hydrated.erase(it->filepath);
+			it = this->lru.erase(it);
+		}
+	}
+
+	void move(std::string oldFilepath, std::string newFilepath) {
+		this->forget(newFilepath);
+
+		std::vector<std::string> moved;
+		for (auto const &[key, _] : this->placeholders) {
+			if (PathWithin(key, oldFilepath)) {
+				moved.push_back(key);
+			}
+		}
+		for (auto const& key : moved) {
+			std::string renamed = newFilepath + key.substr(oldFilepath.size());
+			auto node = this->placeholders.extract(key);
+			node.key() = renamed;
+			this->placeholders.insert(std::move(node));
+			for (auto& [_, fetch] : this->fetches) {
+				if (fetch.filepath == key) {
+					fetch.filepath = renamed;
+				}
+			}
+		}
+
+		for (auto& entry : this->lru) {
+			if (PathWithin(entry.filepath, oldFilepath)) {
+				this->hydrated.erase(entry.filepath);
+				entry.filepath = newFilepath + entry.filepath.substr(oldFilepath.size());
+			}
+		}
+		for (auto it = this->lru.begin(); it != this->lru.end(); ++it) {
+			this->hydrated[it->filepath] = it;
+		}
+	}
+};
+
+Hydrator* hydrator = nullptr;
+
 class FileWatcher {
 private:
 	std::vector<std::pair<int, fs::path>> watchlist;
 	std::optional<std::string> lastMove;
+	uint32_t lastCookie = 0;
 
 public:
 	int fd;
@@ -99,16 +586,54 @@ public:
 	}
 
 	void add(fs::path path) {
+		if (path != this->base && client.ignore.ignored(path.string().substr(this->base.length() + 1), true)) {
+			std::cout << "[FW] Ignoring: " << path << std::endl;
+			return;
+		}
+
+		this->watch(path);
+		for (auto const& entry : fs::directory_iterator{path}) {
+			if (entry.is_directory()) {
+				this->add(entry.path());
+			}
+		}
+	}
+
+	void watch(fs::path path) {
 		std::cout << "[FW] Watching: " << path;
 		this->watchlist.push_back({
 			try_or_exit(inotify_add_watch(this->fd, path.c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVE | IN_DELETE), "inotify_add_watch"),
 			path
 		});
 		std::cout << " (" << this->watchlist.crbegin()->first << ")" << std::endl;
+	}
 
-		for (auto const& entry : fs::directory_iterator{path}) {
-			if (entry.is_directory()) {
-				this->add(entry.path());
+	// Brings the watches in line with changed ignore rules: directories that
+	// are ignored now lose theirs, those that no longer are get one.
+	void rescan() {
+		std::erase_if(this->watchlist, [this](auto const& entry) {
+			auto const& [wd, path] = entry;
+			if (path == this->base || !client.ignore.ignored(path.string().substr(this->base.length() + 1), true)) {
+				return false;
+			}
+			std::cout << "[FW] Removing: " << path << " (" << wd << ")" << std::endl;
+			inotify_rm_watch(this->fd, wd);
+			return true;
+		});
+
+		std::set<fs::path> watched;
+		for (auto const& [_, path] : this->watchlist) {
+			watched.insert(path);
+		}
+		std::error_code ec;
+		for (auto it = fs::recursive_directory_iterator(this->base, ec); it != fs::recursive_directory_iterator(); it.increment(ec)) {
+			if (!it->is_directory()) {
+				continue;
+			}
+			if (client.ignore.ignored(it->path().string().substr(this->base.length() + 1), true)) {
+				it.disable_recursion_pending();
+			} else if (!watched.contains(it->path())) {
+				this->watch(it->path());
 			}
 		}
 	}
@@ -126,6 +651,18 @@ public:
 		}
 	}
 
+	void upload(fs::path path, std::string strpath) {
+		// The event predates the placeholder, which has nothing to upload.
+		if (hydrator && hydrator->isPlaceholder(strpath)) {
+			return;
+		}
+		if (hydrator) {
+			hydrator->forget(strpath);
+		}
+		ssize_t mtime = fs::last_write_time(path).time_since_epoch().count();
+		this->server->sendFile(strpath, mtime, FormatVersion(client.versions.bump(strpath)), path);
+	}
+
 	void handle() {
 		char buf[BUFFER_SIZE] __attribute__((aligned(alignof(inotify_event))));
 		inotify_event* event;
@@ -161,9 +698,19 @@ public:
 				continue;
 			}
 
+			// Staging files of SyncDir::updateFile are never synced themselves,
+			// anonymous O_TMPFILE ones report a "#<inode>" name that doesn't exist.
+			if (IsStagingName(*path) && !(event->mask & IN_MOVED_FROM)) {
+				continue;
+			}
+			if ((event->mask & IN_CLOSE_WRITE) && !fs::exists(*path)) {
+				continue;
+			}
+			bool published = (event->mask & IN_MOVED_TO) && this->lastMove && IsStagingName(*this->lastMove);
+
 			bool end = false;
 			std::string target = path->string();
-			if (event->mask & IN_CLOSE_WRITE) {
+			if (event->mask & IN_CLOSE_WRITE || published) {
 				target = "u" + target;
 			} else if (event->mask & IN_DELETE) {
 				target = "d" + target;
@@ -181,26 +728,28 @@ public:
 			}
 			if (end) continue;
 
+			bool isDir = event->mask & IN_ISDIR;
+			if (strpath == IGNORE_FILE && (event->mask & (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_TO))) {
+				client.reloadIgnore();
+			}
+			// Moves are checked below, they may cross into or out of ignored paths.
+			if ((!(event->mask & IN_MOVE) || published) && client.ignore.ignored(strpath, isDir)) {
+				continue;
+			}
+
+			// Everything sent for this event is traced as one operation, a move
+			// starts with its IN_MOVED_TO.
+			bool traced = (event->mask & (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_TO)) || published;
+			TraceScope scope(traced ? NewTraceId() : 0);
+			TraceStage(Stage::Notify, currentTrace, strpath);
+
 			std::ostringstream oss;
-			ssize_t mtime = (event->mask & (IN_DELETE | IN_MOVED_FROM)) ? 0 : fs::last_write_time(*path).time_since_epoch().count();
-			if (event->mask & IN_CLOSE_WRITE) {
+			std::vector<std::string> paths;
+			if (event->mask & IN_CLOSE_WRITE || published) {
+				this->lastMove.reset();
 				std::cout << "[FW] IN_CLOSE_WRITE: " << event->wd
 					<< " [file]" << std::endl;
-				
-				oss << 'u' << strpath << '\n' << mtime << " " << fs::file_size(*path) << "\n\n";
-				this->server->sendData(oss.str());
-				
-				int fileFd = open((*path).c_str(), O_RDONLY);
-				if (fileFd == -1) {
-					std::cerr << "File doesn't exist" << std::endl;
-				}
-				char buffer[BUFFER_SIZE];
-				ssize_t bytesRead;
-				while ((bytesRead = read(fileFd, buffer, BUFFER_SIZE)) > 0) {
-					if (!this->server->sendData(buffer, bytesRead)) {
-						std::cerr << "Failed to send file to client." << std::endl;
-					}
-				}
+				this->upload(*path, strpath);
 
 				continue;
 			}
@@ -218,34 +767,121 @@ public:
 					std::cout << " [file]" << std::endl;
 				}
 
+				client.versions.erase(strpath);
+				if (hydrator) {
+					hydrator->forget(strpath);
+				}
 				oss << 'd' << strpath << "\n\n";
+				paths = {strpath};
 			}	else if (event->mask & IN_MOVED_FROM) {
 				std::cout << "[FW] IN_MOVED_FROM: " << event->wd << std::endl;
 				this->lastMove = strpath;
+				this->lastCookie = event->cookie;
 			}
 			else if (event->mask & IN_MOVED_TO) {
 				std::cout << "[FW] IN_MOVED_TO: " << event->wd << std::endl;
-				if (this->lastMove) {
-					if (event->mask & IN_ISDIR) {
+				// Without its IN_MOVED_FROM the file came from outside the tree or
+				// from an ignored directory, which isn't watched.
+				bool paired = this->lastMove && this->lastCookie == event->cookie;
+				if (event->mask & IN_ISDIR) {
+					if (paired) {
 						this->remove(*this->lastMove, true);
-						this->add(*path);
 					}
+					this->add(*path);
+				}
 
-					oss << 'm' << *this->lastMove << "\n" << strpath << "\n\n";
+				bool oldIgnored = !paired || client.ignore.ignored(*this->lastMove, isDir);
+				bool newIgnored = client.ignore.ignored(strpath, isDir);
+				if (oldIgnored && newIgnored) {
+					continue;
+				} else if (newIgnored) {
+					client.versions.erase(*this->lastMove);
+					if (hydrator) {
+						hydrator->forget(*this->lastMove);
+					}
+					oss << 'd' << *this->lastMove << "\n\n";
+					paths = {*this->lastMove};
+				} else if (oldIgnored) {
+					// The server never got the file, so to it the file is new, as
+					// is everything in a directory.
+					if (isDir) {
+						client.walk(client.base / strpath, [this](std::string filepath, const fs::directory_entry& entry) {
+							this->upload(entry.path(), filepath);
+						});
+					} else {
+						this->upload(*path, strpath);
+					}
+					continue;
 				} else {
-					std::cerr << "!!! Unknown move: ??? -> " << *path << std::endl;
+					client.versions.move(*this->lastMove, strpath);
+					if (hydrator) {
+						hydrator->move(*this->lastMove, strpath);
+					}
+					oss << 'm' << *this->lastMove << "\n" << strpath << "\n\n";
+					paths = {*this->lastMove, strpath};
 				}
 			}
 			else {
 				std::cout << std::format("[FW] UNKNOWN ({:#04x}): ", event->mask);
 			}
-			this->server->sendData(oss.str());
+			if (!oss.str().empty()) {
+				this->server->send(oss.str(), paths);
+			}
 		}
 	}
 };
 
 FileWatcher* fw;
 
+bool Client::placeholder(std::string filepath, ssize_t mtime, ssize_t len, std::string version, Socket* source) {
+	this->publishPending(filepath);
+	VersionVector merged;
+	if (!this->supersedes(filepath, mtime, len, ParseVersion(version), source, merged)) {
+		return false;
+	}
+
+	fs::path target = this->base / filepath;
+	CreateDirectoryRecursive(target.parent_path().string());
+	StagedFile file(target.parent_path());
+	if (file.fd == -1 || ftruncate(file.fd, len) == -1
+		|| !hydrator->prepare(file.fd, filepath, len, version)
+		|| !file.publish(target, this->commit)) {
+		std::cerr << "Failed to create placeholder \"" << filepath << "\"." << std::endl;
+		hydrator->forget(filepath);
+		return false;
+	}
+
+	this->versions.set(filepath, merged);
+	return true;
+}
+
+void Client::updateFilePostHook(std::string filepath, [[maybe_unused]] ssize_t _1, [[maybe_unused]] ssize_t _2, [[maybe_unused]] Socket* _3) {
+	// Only now, a local edit made while the file was on its way is still
+	// uploaded and an aborted one leaves nothing behind.
+	fw->server->lastSentFromServer.push_front("u" + fw->base + "/" + filepath);
+	if (hydrator) {
+		hydrator->forget(filepath);
+	}
+}
+
+void Client::moveFilePostHook(std::string oldFilepath, std::string newFilepath, [[maybe_unused]] Socket* _) {
+	if (hydrator) {
+		hydrator->move(oldFilepath, newFilepath);
+	}
+}
+
+void Client::deleteFilePostHook(std::string filepath, [[maybe_unused]] bool _1, [[maybe_unused]] Socket* _2, [[maybe_unused]] uintmax_t _3) {
+	if (hydrator) {
+		hydrator->forget(filepath);
+	}
+}
+
+void Client::reloadIgnorePostHook() {
+	if (fw) {
+		fw->rescan();
+	}
+}
+
 void Server::handle(std::vector<char> buf) {
 	std::string rest(buf.data() + 1, buf.size() - 1);
 	switch (buf[0]) {
@@ -254,12 +890,61 @@ void Server::handle(std::vector<char> buf) {
 		break;
 	case 'u': {
 		std::istringstream iss(rest);
-		std::string filepath;
+		std::string filepath, version;
+		ssize_t len, mtime;
+		uint32_t stream;
+		std::getline(iss, filepath);
+		iss >> mtime >> len >> stream >> version;
+		client.updateFile(filepath, mtime, len, stream, version, this);
+	} break;
+	case 'i': {
+		std::istringstream iss(rest);
+		std::string filepath, version;
 		ssize_t len, mtime;
 		std::getline(iss, filepath);
-		iss >> mtime >> len;
-		fw->server->lastSentFromServer.push_front("u" + fw->base + "/" + filepath);
-		client.updateFile(filepath, mtime, len, this);
+		iss >> mtime >> len >> version;
+		if (hydrator && client.placeholder(filepath, mtime, len, version, this)) {
+			fw->server->lastSentFromServer.push_front("u" + fw->base + "/" + filepath);
+		}
+	} break;
+	case 'g': {
+		std::istringstream iss(rest);
+		std::string filepath, version;
+		ssize_t offset, len;
+		uint32_t stream;
+		std::getline(iss, filepath);
+		iss >> offset >> len >> stream >> version;
+		if (hydrator) {
+			hydrator->receive(filepath, offset, len, stream, version);
+		} else if (len > 0) {
+			this->cancelIncoming(stream);
+		}
+	} break;
+	case 'a': {
+		uint32_t stream = std::stoul(rest);
+		if (!hydrator || !hydrator->abort(stream)) {
+			client.abortFile(stream, this);
+		}
+	} break;
+	case 'h': {
+		std::istringstream iss(rest);
+		uint32_t stream;
+		ssize_t len;
+		iss >> stream >> len;
+		if (!hydrator || !hydrator->append(stream, nullptr, len)) {
+			client.appendFile(stream, nullptr, len, this);
+		}
+	} break;
+	case 'k':
+		this->cancelOutgoing(std::stoul(rest));
+		break;
+	case 'x': {
+		// The server's version follows unless it is already on its way.
+		std::istringstream iss(rest);
+		std::string filepath, version;
+		std::getline(iss, filepath);
+		std::getline(iss, version);
+		std::cerr << "Conflict detected on " << filepath << " (server at " << version << ")" << std::endl;
 	} break;
 	case 'd': {
 		if (rest.size() > 0) {
@@ -283,6 +968,12 @@ void Server::handle(std::vector<char> buf) {
 	}
 }
 
+void Server::handleChunk(uint32_t stream, const char* buf, ssize_t len) {
+	if (!hydrator || !hydrator->append(stream, buf, len)) {
+		client.appendFile(stream, buf, len, this);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	if (argc < 3) {
 		std::cerr << "Usage: ./client <server_ip> <server_port>" << std::endl;
@@ -330,7 +1021,7 @@ int main(int argc, char *argv[]) {
 	Server* serverptr = new Server(sock);
 	
 	epoll_event event{};
-	event.events = EPOLLIN | EPOLLET;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
 	event.data.ptr = serverptr;
 
 	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &event) == -1) {
@@ -342,16 +1033,49 @@ int main(int argc, char *argv[]) {
 
 	fw = new FileWatcher("sync", serverptr);
 
-	event.data.fd = fw->fd;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = fw;
 	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fw->fd, &event) == -1) {
 		std::cerr << "Failed to add file watcher to epoll." << std::endl;
 		return 1;
 	}
 
+	if (LazyFromEnv()) {
+		hydrator = new Hydrator("sync", serverptr);
+		event.data.ptr = hydrator;
+		if (hydrator->fd == -1 || epoll_ctl(epollFd, EPOLL_CTL_ADD, hydrator->fd, &event) == -1) {
+			std::cerr << "Lazy mode is unavailable, syncing eagerly." << std::endl;
+			delete hydrator;
+			hydrator = nullptr;
+		} else {
+			hydrator->scan();
+			serverptr->send("l\n\n");
+		}
+	}
+
+	event.data.ptr = &client.commit;
+	if (client.commit.notify != -1 && epoll_ctl(epollFd, EPOLL_CTL_ADD, client.commit.notify, &event) == -1) {
+		std::cerr << "Failed to add group commit to epoll." << std::endl;
+		return 1;
+	}
+
 	std::vector<epoll_event> events(MAX_EVENTS);
 
-	while (true) {
-		int numEvents = epoll_wait(epollFd, events.data(), MAX_EVENTS, -1);
+	signal(SIGUSR2, [](int) { traceToggle = 1; });
+	// Sent when an open breaks the lease held while evicting a file.
+	signal(SIGIO, SIG_IGN);
+	// Stopped from the event loop, so the trace is written out.
+	signal(SIGINT, [](int) { stopping = 1; });
+	signal(SIGTERM, [](int) { stopping = 1; });
+	tracer.configure("client");
+
+	while (!stopping) {
+		int numEvents = epoll_wait(epollFd, events.data(), MAX_EVENTS, serverptr->backlog() ? 0 : tracer.timeout());
+		tracer.tick();
+		if (traceToggle) {
+			traceToggle = 0;
+			tracer.toggle();
+		}
 		if (numEvents == -1) {
 			if (errno == EAGAIN || errno == EINTR) {
 				continue;
@@ -362,15 +1086,44 @@ int main(int argc, char *argv[]) {
 			return 1;
 		}
 
+		// Local changes are versioned before updates from the server are applied,
+		// so a file edited in the meantime is seen as a conflict, not overwritten.
+		std::partition(events.begin(), events.begin() + numEvents, [](const epoll_event& event) {
+			return event.data.ptr == fw;
+		});
+
+		bool connected = true;
 		for (int i = 0; i < numEvents; ++i) {
-			if (events[i].data.fd == fw->fd) {
+			if (events[i].data.ptr == fw) {
 				fw->handle();
+			} else if (events[i].data.ptr == hydrator) {
+				hydrator->handle();
+			} else if (events[i].data.ptr == &client.commit) {
+				client.commit.drain();
+				client.publishFlushed();
+				// Descriptors held for the commit may have kept files from eviction.
+				if (hydrator) {
+					hydrator->evict();
+				}
 			} else {
-				((Server*)events[i].data.ptr)->readData();
+				if (events[i].events & EPOLLOUT) {
+					serverptr->writeBlocked = false;
+				}
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					connected = serverptr->readData();
+				}
 			}
 		}
+
+		if (!connected || (serverptr->readBacklog && !serverptr->readData()) || !serverptr->flush()) {
+			std::cerr << "Lost connection to server." << std::endl;
+			close(epollFd);
+			return 1;
+		}
 	};
 
+	client.publishPending();
+	tracer.stop();
 	close(sock);
 	close(epollFd);
 
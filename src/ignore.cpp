@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <fstream>
+
+#include "ignore.h"
+
+static bool HasWildcard(std::string_view pattern) {
+	return pattern.find_first_of("*?[\\") != std::string_view::npos;
+}
+
+void IgnoreRules::compile(std::string line) {
+	while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+		line.pop_back();
+	}
+	if (line.empty() || line[0] == '#') {
+		return;
+	}
+
+	Rule rule{"", false, false, false};
+	if (line[0] == '!') {
+		rule.negate = true;
+		line.erase(0, 1);
+	} else if (line[0] == '\\' && line.size() > 1 && (line[1] == '!' || line[1] == '#')) {
+		line.erase(0, 1);
+	}
+
+	if (!line.empty() && line.back() == '/') {
+		rule.dirOnly = true;
+		line.pop_back();
+	}
+	if (line.starts_with("**/") && line.find('/', 3) == std::string::npos) {
+		// "**/name" matches at any depth, just like a plain "name".
+		line.erase(0, 3);
+	}
+	if (line.find('/') != std::string::npos) {
+		rule.anchored = true;
+		if (line[0] == '/') {
+			line.erase(0, 1);
+		}
+	}
+	if (line.empty()) {
+		return;
+	}
+
+	rule.pattern = line;
+	size_t index = this->rules.size();
+	this->rules.push_back(rule);
+
+	if (!HasWildcard(line)) {
+		(rule.anchored ? this->paths : this->names)[line].push_back(index);
+	} else if (!rule.anchored && line.starts_with("*.") && !HasWildcard(line.substr(1))) {
+		this->suffixes[line.substr(1)].push_back(index);
+	} else {
+		(rule.anchored ? this->pathGlobs : this->nameGlobs).add(line, index, rule.dirOnly);
+	}
+}
+
+bool IgnoreRules::load(const std::string& filepath) {
+	this->rules.clear();
+	this->names.clear();
+	this->paths.clear();
+	this->suffixes.clear();
+	this->nameGlobs.clear();
+	this->pathGlobs.clear();
+
+	std::ifstream file(filepath);
+	if (!file.is_open()) {
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(file, line)) {
+		this->compile(line);
+	}
+
+	return true;
+}
+
+void IgnoreRules::pick(const std::vector<size_t>& candidates, bool isDir, ssize_t& best) const {
+	for (size_t index : candidates) {
+		if ((ssize_t) index > best && (isDir || !this->rules[index].dirOnly)) {
+			best = index;
+		}
+	}
+}
+
+bool IgnoreRules::decide(std::string_view path, bool isDir) const {
+	size_t slash = path.rfind('/');
+	std::string_view name = slash == std::string_view::npos ? path : path.substr(slash + 1);
+
+	// As in gitignore, the last matching rule wins.
+	ssize_t best = -1;
+	if (auto it = this->names.find(std::string(name)); it != this->names.end()) {
+		this->pick(it->second, isDir, best);
+	}
+	if (auto it = this->paths.find(std::string(path)); it != this->paths.end()) {
+		this->pick(it->second, isDir, best);
+	}
+	if (!this->suffixes.empty()) {
+		for (size_t dot = name.find('.'); dot != std::string_view::npos; dot = name.find('.', dot + 1)) {
+			if (auto it = this->suffixes.find(std::string(name.substr(dot))); it != this->suffixes.end()) {
+				this->pick(it->second, isDir, best);
+			}
+		}
+	}
+	best = std::max({best, this->nameGlobs.match(name, isDir), this->pathGlobs.match(path, isDir)});
+
+	return best != -1 && !this->rules[best].negate;
+}
+
+bool IgnoreRules::ignored(std::string_view path, bool isDir) const {
+	if (this->rules.empty()) {
+		return false;
+	}
+
+	// A file can't be re-included once one of its parent directories is ignored.
+	for (size_t slash = path.find('/'); slash != std::string_view::npos; slash = path.find('/', slash + 1)) {
+		if (this->decide(path.substr(0, slash), true)) {
+			return true;
+		}
+	}
+
+	return this->decide(path, isDir);
+}
+
+static uint64_t Position(size_t glob, size_t token, bool inside) {
+	return (uint64_t) glob << 32 | token << 1 | inside;
+}
+
+void GlobSet::add(std::string_view pattern, size_t rule, bool dirOnly) {
+	Glob glob{{}, rule, dirOnly};
+	std::bitset<256> any;
+	any.set();
+	any.reset('/');
+
+	size_t p = 0;
+	while (p < pattern.size()) {
+		Token token{Token::Char, {}};
+		switch (pattern[p]) {
+		case '*': {
+			bool component = (p == 0 || pattern[p - 1] == '/')
+				&& p + 1 < pattern.size() && pattern[p + 1] == '*'
+				&& (p + 2 == pattern.size() || pattern[p + 2] == '/');
+			if (component) {
+				token.kind = p + 2 == pattern.size() ? Token::Rest : Token::Dirs;
+				p += 3;
+			} else {
+				token.kind = Token::Star;
+				while (p < pattern.size() && pattern[p] == '*') {
+					++p;
+				}
+			}
+		} break;
+		case '?':
+			token.chars = any;
+			++p;
+			break;
+		case '[': {
+			size_t end = pattern.find(']', p + 2);
+			if (end == std::string_view::npos) {
+				goto literal;
+			}
+
+			size_t start = p + 1;
+			bool negate = pattern[start] == '!' || pattern[start] == '^';
+			if (negate) {
+				++start;
+			}
+			for (size_t i = start; i < end; ++i) {
+				if (i + 2 < end && pattern[i + 1] == '-') {
+					for (int c = 0; c < 256; ++c) {
+						if (pattern[i] <= (char) c && (char) c <= pattern[i + 2]) {
+							token.chars.set(c);
+						}
+					}
+					i += 2;
+				} else {
+					token.chars.set((unsigned char) pattern[i]);
+				}
+			}
+			if (negate) {
+				token.chars.flip();
+			}
+			token.chars.reset('/');
+			p = end + 1;
+		} break;
+		case '\\':
+			if (p + 1 < pattern.size()) {
+				++p;
+			}
+			[[fallthrough]];
+		default:
+		literal:
+			token.chars.set((unsigned char) pattern[p]);
+			++p;
+			break;
+		}
+		glob.tokens.push_back(token);
+	}
+
+	this->globs.push_back(std::move(glob));
+	this->reset();
+}
+
+void GlobSet::clear() {
+	this->globs.clear();
+	this->reset();
+}
+
+void GlobSet::reset() const {
+	this->states.clear();
+	this->ids.clear();
+}
+
+// Adds position and the positions reachable from it without a character.
+void GlobSet::close(uint64_t position, std::vector<uint64_t>& out) const {
+	while (true) {
+		out.push_back(position);
+		const Glob& glob = this->globs[position >> 32];
+		size_t token = (uint32_t) position >> 1;
+		if ((position & 1) || token == glob.tokens.size()) {
+			return;
+		}
+		Token::Kind kind = glob.tokens[token].kind;
+		if (kind != Token::Star && kind != Token::Dirs) {
+			return;
+		}
+		position = Position(position >> 32, token + 1, false);
+	}
+}
+
+std::vector<uint64_t> GlobSet::step(const std::vector<uint64_t>& positions, unsigned char c) const {
+	std::vector<uint64_t> out;
+	for (uint64_t position : positions) {
+		size_t index = position >> 32;
+		const Glob& glob = this->globs[index];
+		size_t token = (uint32_t) position >> 1;
+		if (token == glob.tokens.size()) {
+			continue;
+		}
+
+		const Token& current = glob.tokens[token];
+		if ((position & 1) || current.kind == Token::Dirs) {
+			out.push_back(Position(index, token, true));
+			if (c == '/') {
+				this->close(Position(index, token + 1, false), out);
+			}
+			continue;
+		}
+		switch (current.kind) {
+		case Token::Char:
+			if (current.chars.test(c)) {
+				this->close(Position(index, token + 1, false), out);
+			}
+			break;
+		case Token::Star:
+			if (c != '/') {
+				this->close(position, out);
+			}
+			break;
+		case Token::Rest:
+			out.push_back(position);
+			break;
+		case Token::Dirs:
+			break;
+		}
+	}
+
+	std::sort(out.begin(), out.end());
+	out.erase(std::unique(out.begin(), out.end()), out.end());
+	return out;
+}
+
+int32_t GlobSet::intern(std::vector<uint64_t> positions) const {
+	if (auto it = this->ids.find(positions); it != this->ids.end()) {
+		return it->second;
+	}
+
+	State state{positions, -1, -1, {}};
+	state.next.fill(-1);
+	for (uint64_t position : positions) {
+		const Glob& glob = this->globs[position >> 32];
+		size_t token = (uint32_t) position >> 1;
+		bool accepts = !(position & 1)
+			&& (token == glob.tokens.size() || glob.tokens[token].kind == Token::Rest);
+		if (!accepts) {
+			continue;
+		}
+		state.bestDir = std::max(state.bestDir, (ssize_t) glob.rule);
+		if (!glob.dirOnly) {
+			state.bestFile = std::max(state.bestFile, (ssize_t) glob.rule);
+		}
+	}
+
+	int32_t id = this->states.size();
+	this->states.push_back(std::move(state));
+	this->ids.emplace(std::move(positions), id);
+	return id;
+}
+
+// Builds the start state, which always gets id 0.
+void GlobSet::begin() const {
+	std::vector<uint64_t> start;
+	for (size_t index = 0; index < this->globs.size(); ++index) {
+		this->close(Position(index, 0, false), start);
+	}
+	std::sort(start.begin(), start.end());
+	start.erase(std::unique(start.begin(), start.end()), start.end());
+	this->intern(std::move(start));
+}
+
+ssize_t GlobSet::match(std::string_view text, bool isDir) const {
+	if (this->globs.empty()) {
+		return -1;
+	}
+	if (this->states.empty()) {
+		this->begin();
+	}
+
+	int32_t current = 0;
+	for (unsigned char c : text) {
+		if (this->states[current].positions.empty()) {
+			return -1;
+		}
+
+		int32_t next = this->states[current].next[c];
+		if (next == -1) {
+			std::vector<uint64_t> positions = this->step(this->states[current].positions, c);
+			if (this->states.size() < GLOB_DFA_STATES) {
+				next = this->intern(std::move(positions));
+				this->states[current].next[c] = next;
+			} else {
+				// Texts rarely need many states, so instead of evicting some
+				// the cache starts over from this one.
+				this->reset();
+				this->begin();
+				next = this->intern(std::move(positions));
+			}
+		}
+		current = next;
+	}
+
+	const State& state = this->states[current];
+	return isDir ? state.bestDir : state.bestFile;
+}
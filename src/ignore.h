@@ -0,0 +1,100 @@
+#pragma once
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+constexpr const char* IGNORE_FILE = ".syncignore";
+// A GlobSet forgets the states it built once it has this many.
+constexpr size_t GLOB_DFA_STATES = 1024;
+
+// Matches a text against many globs at once. "*" and "?" never match "/",
+// "**" matches across directories when it forms a whole path component.
+// The globs form one NFA, whose sets of states become DFA states as texts
+// reach them, so a lookup costs a table step per character however many
+// globs there are.
+class GlobSet {
+	struct Token {
+		enum Kind : uint8_t {
+			// One of chars.
+			Char,
+			// Any run of characters but "/".
+			Star,
+			// "**/", nothing or anything up to a "/".
+			Dirs,
+			// A trailing "**", anything at all.
+			Rest,
+		} kind;
+		std::bitset<256> chars;
+	};
+
+	struct Glob {
+		std::vector<Token> tokens;
+		size_t rule;
+		bool dirOnly;
+	};
+
+	// NFA states are packed as glob << 32 | token << 1 | inside, where inside
+	// means within the directories matched by a "**/".
+	struct State {
+		std::vector<uint64_t> positions;
+		ssize_t bestFile;
+		ssize_t bestDir;
+		std::array<int32_t, 256> next;
+	};
+
+	std::vector<Glob> globs;
+	mutable std::vector<State> states;
+	mutable std::map<std::vector<uint64_t>, int32_t> ids;
+
+	void close(uint64_t position, std::vector<uint64_t>& out) const;
+	std::vector<uint64_t> step(const std::vector<uint64_t>& positions, unsigned char c) const;
+	int32_t intern(std::vector<uint64_t> positions) const;
+	void begin() const;
+	void reset() const;
+
+public:
+	void add(std::string_view pattern, size_t rule, bool dirOnly);
+	void clear();
+	// Highest rule whose glob matches text, -1 if there is none.
+	ssize_t match(std::string_view text, bool isDir) const;
+};
+
+// Gitignore-style rules read from a .syncignore file. Rules are compiled once
+// into hash buckets for literal names, literal paths and "*.ext" suffixes, so
+// a lookup costs a few hash probes no matter how many of those there are.
+// Rules with real wildcards go into a GlobSet for names and one for paths.
+class IgnoreRules {
+	struct Rule {
+		std::string pattern;
+		bool negate;
+		bool dirOnly;
+		// Matched against the whole relative path instead of the basename.
+		bool anchored;
+	};
+
+	std::vector<Rule> rules;
+	std::unordered_map<std::string, std::vector<size_t>> names;
+	std::unordered_map<std::string, std::vector<size_t>> paths;
+	std::unordered_map<std::string, std::vector<size_t>> suffixes;
+	GlobSet nameGlobs;
+	GlobSet pathGlobs;
+
+	void compile(std::string line);
+	void pick(const std::vector<size_t>& candidates, bool isDir, ssize_t& best) const;
+	bool decide(std::string_view path, bool isDir) const;
+
+public:
+	bool load(const std::string& filepath);
+	// path is relative to the synced directory, e.g. "build/out.o".
+	bool ignored(std::string_view path, bool isDir) const;
+
+	inline bool empty() const {
+		return this->rules.empty();
+	}
+};
@@ -1,13 +1,20 @@
+#include <atomic>
 #include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
 #include <fcntl.h>
-#include <fstream>
+#include <csignal>
 #include <iostream>
 #include <ostream>
+#include <sstream>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "lib.h"
 
-Socket::Socket(int fd) : readOffset(0), fd(fd) {
+Socket::Socket(int fd) : readOffset(0), chunkStream(0), chunkRemaining(0), trace(0), writeOffset(0), fd(fd), readBacklog(false), writeBlocked(false) {
 	fcntl(this->fd, F_SETFL, O_NONBLOCK);
 	memset(this->readBuf, 0, sizeof(this->readBuf));
 }
@@ -17,139 +24,685 @@ Socket::~Socket() {
 }
 
 bool Socket::readData() {
-	ssize_t len = read(this->fd, this->readBuf + this->readOffset, sizeof(this->readBuf) - this->readOffset);
-	if (len == -1) {
-		if (errno != EAGAIN) {
+	this->readBacklog = false;
+	for (ssize_t budget = IO_BUDGET; budget > 0;) {
+		if (this->readOffset == sizeof(this->readBuf)) {
+			std::cerr << "Command too long." << std::endl;
 			return false;
 		}
 
-		len = 0;
+		ssize_t len = read(this->fd, this->readBuf + this->readOffset, sizeof(this->readBuf) - this->readOffset);
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno == EAGAIN;
+		}
+
+		if (len == 0) {
+			return false;
+		}
+
+		this->readOffset += len;
+		budget -= len;
+		this->parse();
 	}
 
-	if (len == 0) {
-		return false;
+	this->readBacklog = true;
+	return true;
+}
+
+void Socket::parse() {
+	ssize_t pos = 0;
+	while (pos < this->readOffset) {
+		if (this->chunkRemaining > 0) {
+			ssize_t len = std::min(this->chunkRemaining, this->readOffset - pos);
+			this->handleChunk(this->chunkStream, this->readBuf + pos, len);
+			this->chunkRemaining -= len;
+			pos += len;
+			continue;
+		}
+
+		char* end = (char*) memmem(this->readBuf + pos, this->readOffset - pos, "\n\n", 2);
+		if (end == nullptr) {
+			break;
+		}
+
+		ssize_t i = end - this->readBuf;
+		if (this->readBuf[pos] == 'c') {
+			sscanf(this->readBuf + pos + 1, "%" SCNu32 " %zd", &this->chunkStream, &this->chunkRemaining);
+		} else if (this->readBuf[pos] == 't') {
+			this->trace = strtoull(this->readBuf + pos + 1, nullptr, 16);
+		} else if (i > pos) {
+			write(2, this->readBuf + pos, i - pos + 1);
+			std::vector<char> cmd(this->readBuf + pos, this->readBuf + i);
+			TraceScope scope(this->trace);
+			this->trace = 0;
+			std::string_view header(cmd.data(), cmd.size());
+			TraceStage(Stage::Receive, currentTrace, header.substr(0, header.find('\n')));
+			this->handle(cmd);
+		}
+		pos = i + 2;
 	}
 
-	this->readOffset += len;
-	for (int i = 1; i < this->readOffset; ++i) {
-		if (this->readBuf[i] == '\n' && this->readBuf[i - 1] == '\n') {
-			write(2, this->readBuf, i);
-			this->readBuf[i] = 0;
-			this->readBuf[i - 1] = 0;
+	this->readOffset -= pos;
+	memmove(this->readBuf, this->readBuf + pos, this->readOffset);
+}
+
+void Socket::send(std::string message, std::vector<std::string> paths) {
+	auto item = std::make_shared<Outgoing>();
+	item->message = message;
+	item->paths = paths;
+	item->trace = currentTrace;
+	this->outbox.push(item);
+}
+
+void Socket::sendFile(std::string filepath, ssize_t mtime, std::string version, fs::path source) {
+	std::error_code ec;
+	uintmax_t size = fs::file_size(source, ec);
+	if (ec) {
+		std::cerr << "Failed to send file \"" << filepath << "\"." << std::endl;
+		return;
+	}
 
-			std::vector<char> cmd;//(this->readBuf, this->readBuf + i - 1);
-			for (int j = 0; j < i - 1; ++j) {
-				cmd.push_back(this->readBuf[j]);
+	auto item = std::make_shared<Outgoing>();
+	item->priority = (ssize_t) size <= SMALL_FILE_SIZE ? Priority::Small : Priority::Bulk;
+	item->filepath = filepath;
+	item->mtime = mtime;
+	item->version = version;
+	item->source = source;
+	item->paths = {filepath};
+	item->trace = currentTrace;
+	this->outbox.push(item);
+}
+
+void Socket::sendFile(std::string filepath, ssize_t mtime, std::string version, std::shared_ptr<const Blob> content) {
+	auto item = std::make_shared<Outgoing>();
+	item->priority = (ssize_t) content->size <= SMALL_FILE_SIZE ? Priority::Small : Priority::Bulk;
+	item->filepath = filepath;
+	item->mtime = mtime;
+	item->version = version;
+	item->content = content;
+	item->paths = {filepath};
+	item->trace = currentTrace;
+	this->outbox.push(item);
+}
+
+void Socket::sendRange(std::string filepath, ssize_t offset, ssize_t len, std::string version, fs::path source) {
+	auto item = std::make_shared<Outgoing>();
+	// Someone is waiting for the file to open.
+	item->priority = Priority::Small;
+	item->range = true;
+	item->filepath = filepath;
+	item->offset = offset;
+	item->remaining = len;
+	item->version = version;
+	item->source = source;
+	item->paths = {filepath};
+	this->outbox.push(item);
+}
+
+void Socket::sendRange(std::string filepath, ssize_t offset, ssize_t len, std::string version, std::shared_ptr<const Blob> content) {
+	auto item = std::make_shared<Outgoing>();
+	item->priority = Priority::Small;
+	item->range = true;
+	item->filepath = filepath;
+	item->offset = offset;
+	item->remaining = len;
+	item->version = version;
+	item->content = content;
+	item->paths = {filepath};
+	this->outbox.push(item);
+}
+
+void Socket::cancelIncoming(uint32_t stream) {
+	std::ostringstream oss;
+	oss << "k" << stream << "\n\n";
+	this->send(oss.str());
+}
+
+void Socket::cancelOutgoing(uint32_t stream) {
+	this->outbox.cancel(stream);
+}
+
+bool Socket::flush() {
+	for (ssize_t budget = IO_BUDGET; budget > 0;) {
+		if (this->writeOffset == this->writeBuf.size()) {
+			this->writeBuf.clear();
+			this->writeOffset = 0;
+			// Coalesce small frames into one write.
+			while (this->writeBuf.size() < CHUNK_SIZE && this->outbox.next(this->writeBuf));
+			if (this->writeBuf.empty()) {
+				return true;
 			}
+		}
 
-			this->readOffset -= ++i;
-			if (this->readOffset < 0) {
-				this->readOffset = 0;
+		ssize_t res = write(this->fd, this->writeBuf.data() + this->writeOffset, this->writeBuf.size() - this->writeOffset);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
 			}
-			if (this->readOffset > 0) {
-				memmove(this->readBuf, this->readBuf + i, this->readOffset);
+			if (errno == EAGAIN) {
+				this->writeBlocked = true;
+				return true;
 			}
-			i = 0;
 
-			if (cmd.size() > 0) {
-				this->handle(cmd);
-			}
+			return false;
 		}
+
+		this->writeOffset += res;
+		budget -= res;
 	}
 
 	return true;
 }
 
-ssize_t Socket::readData(char* buf, ssize_t blen) {
-	ssize_t len = read(this->fd, this->readBuf + this->readOffset, sizeof(this->readBuf) - this->readOffset);
-	if (len == -1) {
-		if (errno != EAGAIN) {
-			return 0;
-		}
+static Durability DurabilityFromEnv() {
+	const char* env = getenv("SYNC_DURABILITY");
+	std::string_view level = env ? env : "batch";
+	if (level == "none") {
+		return Durability::None;
+	} else if (level == "sync") {
+		return Durability::Sync;
+	} else if (level != "batch") {
+		std::cerr << "Unknown durability \"" << level << "\", using batch." << std::endl;
+	}
 
-		len = 0;
+	return Durability::Batch;
+}
+
+static std::chrono::milliseconds CommitWindowFromEnv() {
+	const char* env = getenv("SYNC_COMMIT_WINDOW_MS");
+	return std::chrono::milliseconds(env ? atoi(env) : 20);
+}
+
+GroupCommit::GroupCommit(Durability level, std::chrono::milliseconds window) : queued(0), flushed(0), stopping(false), level(level), window(window), notify(-1) {
+	if (this->level != Durability::None) {
+		this->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		// Keep signals on the event loop thread, where they interrupt epoll_wait.
+		sigset_t all, old;
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+		this->worker = std::thread(&GroupCommit::run, this);
+		pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	}
+}
+
+GroupCommit::~GroupCommit() {
+	{
+		std::lock_guard guard(this->lock);
+		this->stopping = true;
+	}
+	this->wake.notify_one();
+	this->progress.notify_all();
+	if (this->worker.joinable()) {
+		this->worker.join();
+	}
+	if (this->notify != -1) {
+		close(this->notify);
 	}
+}
 
-	if (len == 0 && this->readOffset == 0) {
+uint64_t GroupCommit::enqueue(int fd, fs::path dir) {
+	if (this->level == Durability::None) {
+		if (fd != -1) {
+			close(fd);
+		}
 		return 0;
 	}
 
-	this->readOffset += len;
-	if (this->readOffset > 0) {
-		len = std::min(blen, this->readOffset);
-		memmove(buf, this->readBuf, len);
+	uint64_t ticket;
+	{
+		std::unique_lock guard(this->lock);
+		this->progress.wait(guard, [this] {
+			return this->stopping || this->pending.size() < GROUP_COMMIT_MAX;
+		});
+		this->pending.push_back({fd, dir});
+		ticket = ++this->queued;
+	}
+	this->wake.notify_one();
+	return ticket;
+}
+
+bool GroupCommit::done(uint64_t ticket) {
+	std::lock_guard guard(this->lock);
+	return ticket <= this->flushed;
+}
+
+void GroupCommit::wait(uint64_t ticket) {
+	std::unique_lock guard(this->lock);
+	this->progress.wait(guard, [this, ticket] {
+		return ticket <= this->flushed;
+	});
+}
+
+void GroupCommit::drain() {
+	uint64_t count;
+	if (read(this->notify, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		perror("eventfd");
+	}
+}
+
+void GroupCommit::run() {
+	std::unique_lock guard(this->lock);
+	while (!this->stopping || !this->pending.empty()) {
+		if (this->pending.empty()) {
+			this->wake.wait(guard);
+			continue;
+		}
+
+		// Give the rest of the window a chance to join this batch.
+		this->wake.wait_for(guard, this->window, [this] {
+			return this->stopping || this->pending.size() >= GROUP_COMMIT_MAX;
+		});
+		std::vector<std::pair<int, fs::path>> batch;
+		batch.swap(this->pending);
+		uint64_t last = this->queued;
+		this->progress.notify_all();
+
+		guard.unlock();
+		this->commit(std::move(batch));
+		guard.lock();
+
+		this->flushed = last;
+		this->progress.notify_all();
+		uint64_t one = 1;
+		if (write(this->notify, &one, sizeof(one)) == -1) {
+			perror("eventfd");
+		}
+	}
+}
+
+void GroupCommit::commit(std::vector<std::pair<int, fs::path>> batch) {
+	if (batch.size() >= SYNCFS_THRESHOLD) {
+		// Everything lives under one base directory, so a single syncfs()
+		// covers file data and directory entries of the whole batch.
+		auto any = std::find_if(batch.begin(), batch.end(), [](auto const& entry) {
+			return entry.first != -1;
+		});
+		int fd = any != batch.end() ? dup(any->first) : open(batch.front().second.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd == -1 || syncfs(fd) == -1) {
+			perror("syncfs");
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+	} else {
+		std::vector<fs::path> dirs;
+		for (auto const &[fd, dir] : batch) {
+			if (fd != -1 && fdatasync(fd) == -1) {
+				perror("fdatasync");
+			}
+			if (!dir.empty() && std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) {
+				dirs.push_back(dir);
+			}
+		}
+
+		for (auto const &dir : dirs) {
+			int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+			if (fd == -1 || fsync(fd) == -1) {
+				perror("fsync");
+			}
+			if (fd != -1) {
+				close(fd);
+			}
+		}
+	}
+
+	for (auto const &[fd, _] : batch) {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+}
+
+static fs::path StagingName(fs::path dir) {
+	static std::atomic<unsigned> counter;
+	return dir / (STAGING_PREFIX + std::to_string(getpid()) + "." + std::to_string(counter++));
+}
 
-		this->readOffset -= len;
-		memmove(this->readBuf, this->readBuf + len, this->readOffset);
+StagedFile::StagedFile(fs::path dir) : dir(dir) {
+	this->fd = open(dir.c_str(), O_TMPFILE | O_WRONLY, 0666);
+	if (this->fd == -1) {
+		this->name = StagingName(dir);
+		this->fd = open(this->name.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+		if (this->fd == -1) {
+			this->name.clear();
+		}
 	}
+}
 
-	return len;
+StagedFile::~StagedFile() {
+	if (this->fd != -1) {
+		close(this->fd);
+	}
+	if (!this->name.empty()) {
+		unlink(this->name.c_str());
+	}
 }
 
-bool Socket::sendData(const char* buf, ssize_t len) {
+bool StagedFile::write(const char* buf, ssize_t len) {
 	while (len > 0) {
-		ssize_t res = write(this->fd, buf, len);
+		ssize_t res = ::write(this->fd, buf, len);
 		if (res == -1) {
-			if (errno == EAGAIN) {
+			if (errno == EINTR) {
 				continue;
 			}
 
 			return false;
 		}
 
-		if (len == 0) {
+		buf += res;
+		len -= res;
+	}
+
+	return true;
+}
+
+bool StagedFile::skip(ssize_t len) {
+	return lseek(this->fd, len, SEEK_CUR) != -1;
+}
+
+bool StagedFile::publish(fs::path target, GroupCommit& commit) {
+	// linkat() refuses to replace an existing name, so an anonymous file is
+	// linked under a staging name first and then renamed over the target.
+	if (this->name.empty()) {
+		fs::path staging = StagingName(this->dir);
+		std::string proc = "/proc/self/fd/" + std::to_string(this->fd);
+		if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, staging.c_str(), AT_SYMLINK_FOLLOW) == -1) {
 			return false;
 		}
+		this->name = staging;
+	} else {
+		// A named file reports its last close under the name it has by then,
+		// so it is closed while that is still the staging name.
+		close(this->fd);
+		this->fd = -1;
+	}
 
-		len -= res;
+	if (rename(this->name.c_str(), target.c_str()) == -1) {
+		return false;
 	}
+	this->name.clear();
 
+	commit.enqueue(-1, this->dir);
 	return true;
 }
 
-SyncDir::SyncDir(fs::path base) : base(base) {}
+SyncDir::SyncDir(fs::path base) : base(base), commit(DurabilityFromEnv(), CommitWindowFromEnv()), versions(base.string() + ".versions") {
+	this->ignore.load(base / IGNORE_FILE);
+}
+
+void SyncDir::walk(fs::path dir, std::function<void(std::string filepath, const fs::directory_entry& entry)> f) {
+	std::error_code ec;
+	for (auto it = fs::recursive_directory_iterator(dir, ec); it != fs::recursive_directory_iterator(); it.increment(ec)) {
+		std::string filepath = it->path().string().substr(this->base.string().length() + 1);
+		bool isDir = it->is_directory();
+		if (IsStagingName(it->path()) || this->ignore.ignored(filepath, isDir)) {
+			if (isDir) {
+				it.disable_recursion_pending();
+			}
+			continue;
+		}
 
-void SyncDir::updateFile(std::string filepath, ssize_t mtime, ssize_t len, Socket* source) {
-	if (fs::exists(this->base / filepath)) {
-		ssize_t LastModTime = fs::last_write_time(this->base / filepath).time_since_epoch().count();
-		if (LastModTime > mtime) {
-			this->updateFileConflictHook(filepath, mtime, len, source);
-			return;
+		if (it->is_regular_file()) {
+			f(filepath, *it);
+		}
+	}
+}
+
+void SyncDir::reloadIgnore() {
+	this->ignore.load(this->base / IGNORE_FILE);
+	reloadIgnorePostHook();
+}
+
+bool SyncDir::supersedes(std::string filepath, ssize_t mtime, ssize_t len, const VersionVector& incoming, Socket* source, VersionVector& merged, ssize_t* settled) {
+	VersionVector local = this->versions.get(filepath);
+	Order order = CompareVersions(incoming, local);
+	bool accept = order == Order::After || !fs::exists(this->base / filepath);
+	if (!accept && order == Order::Concurrent) {
+		std::error_code ec;
+		ssize_t current = fs::last_write_time(this->base / filepath, ec).time_since_epoch().count();
+		accept = (settled && *settled == current) || this->updateFileConflictHook(filepath, mtime, len, source);
+		if (settled && accept) {
+			*settled = current;
+		}
+	}
+	// A conflict the local side lost leaves its edit set aside, so the local
+	// vector has no part in the result.
+	if (accept) {
+		merged = order == Order::Concurrent ? incoming : MergeVersions(incoming, local);
+	}
+	return accept;
+}
+
+bool SyncDir::updateFile(std::string filepath, ssize_t mtime, ssize_t len, uint32_t stream, std::string version, Socket* source) {
+	this->publishPending(filepath);
+	// Decided from the header alone, so a rejected payload can be cancelled
+	// before most of it is sent.
+	VersionVector offered = ParseVersion(version);
+	VersionVector merged;
+	ssize_t settled = -1;
+	if (!this->supersedes(filepath, mtime, len, offered, source, merged, &settled)) {
+		if (len > 0) {
+			source->cancelIncoming(stream);
 		}
+		return false;
 	}
-	CreateDirectoryRecursive((base / filepath).parent_path().string());
-	std::ofstream file(base / filepath, std::ios::out | std::ios::trunc | std::ios::binary);
-	if (!file.is_open()) {
+
+	Incoming file{filepath, mtime, len, 0, this->base / filepath, nullptr, offered, this->versions.get(filepath), merged, currentTrace, settled, nullptr, 0};
+	TraceStage(Stage::Write, file.trace, filepath);
+	// The chunks of a failed payload are still drained from the stream.
+	CreateDirectoryRecursive(file.target.parent_path().string());
+	file.file = std::make_unique<StagedFile>(file.target.parent_path());
+	// Sizing the file up front leaves holes, trailing ones included, unallocated.
+	if (file.file->fd == -1 || ftruncate(file.file->fd, len) == -1) {
 		std::cerr << "Failed to update file \"" << filepath << "\"." << std::endl;
+		file.file.reset();
+	}
+
+	if (len == 0) {
+		this->finishFile(file, source);
+		return true;
+	}
+	source->incoming[stream] = std::move(file);
+	return true;
+}
+
+void SyncDir::appendFile(uint32_t stream, const char* buf, ssize_t len, Socket* source) {
+	auto it = source->incoming.find(stream);
+	if (it == source->incoming.end()) {
+		return;
+	}
+
+	Incoming& file = it->second;
+	if (file.file && !(buf ? file.file->write(buf, len) : file.file->skip(len))) {
+		std::cerr << "Failed to update file \"" << file.filepath << "\"." << std::endl;
+		file.file.reset();
+	}
+
+	file.received += len;
+	if (file.received >= file.len) {
+		this->finishFile(file, source);
+		source->incoming.erase(it);
+	}
+}
+
+void SyncDir::abortFile(uint32_t stream, Socket* source) {
+	source->incoming.erase(stream);
+}
+
+void SyncDir::finishFile(Incoming& file, Socket* source) {
+	if (!file.file) {
+		return;
+	}
+	file.source = source;
+	if (this->commit.level != Durability::Batch) {
+		if (this->commit.level == Durability::Sync && fdatasync(file.file->fd) == -1) {
+			std::cerr << "Failed to update file \"" << file.filepath << "\"." << std::endl;
+			return;
+		}
+		this->publishFile(file);
+		return;
+	}
+
+	// The data has to be on disk before the file replaces anything.
+	if (this->flushing.size() >= GROUP_COMMIT_MAX) {
+		this->commit.wait(this->flushing.front().ticket);
+		this->publishFlushed();
+	}
+	file.ticket = this->commit.enqueue(dup(file.file->fd), {});
+	this->flushingPaths[file.filepath] = file.ticket;
+	this->flushing.push_back(std::move(file));
+}
+
+void SyncDir::publishFile(Incoming& file) {
+	Socket* source = file.source;
+	// The file may have changed here or arrived from elsewhere since the
+	// header was weighed, which is done again against what is there now.
+	// Contents already set aside by the first weighing aren't set aside again.
+	if (this->versions.get(file.filepath) != file.base
+		&& !this->supersedes(file.filepath, file.mtime, file.len, file.offered, source, file.version, &file.settled)) {
+		return;
+	}
+	if (!file.file->publish(file.target, this->commit)) {
+		std::cerr << "Failed to update file \"" << file.filepath << "\"." << std::endl;
+		return;
+	}
+	this->versions.set(file.filepath, file.version);
+	// Whatever the post hook sends on belongs to the same operation.
+	TraceScope scope(file.trace);
+	TraceStage(Stage::Publish, file.trace, file.filepath);
+
+	if (file.filepath == IGNORE_FILE) {
+		this->reloadIgnore();
+	}
+	updateFilePostHook(file.filepath, file.mtime, file.len, source);
+}
+
+void SyncDir::publishFlushed() {
+	while (!this->flushing.empty() && this->commit.done(this->flushing.front().ticket)) {
+		Incoming file = std::move(this->flushing.front());
+		this->flushing.pop_front();
+		auto it = this->flushingPaths.find(file.filepath);
+		if (it != this->flushingPaths.end() && it->second == file.ticket) {
+			this->flushingPaths.erase(it);
+		}
+		this->publishFile(file);
+	}
+}
+
+void SyncDir::publishPending(std::string filepath) {
+	uint64_t ticket = 0;
+	if (filepath.empty()) {
+		ticket = this->flushing.empty() ? 0 : this->flushing.back().ticket;
+	} else if (auto it = this->flushingPaths.find(filepath); it != this->flushingPaths.end()) {
+		ticket = it->second;
+	}
+	if (ticket == 0) {
 		return;
 	}
 
-	char* buf = new char[len];
-	ssize_t i = 0;
-	while (i < len - 1) {
-		ssize_t rlen = source->readData(buf + i, len - i);
-		if (rlen > 0) {
-			file.write(buf + i, rlen);
-			i += rlen;
+	this->commit.wait(ticket);
+	this->publishFlushed();
+}
+
+void SyncDir::detach(Socket* source) {
+	for (auto& file : this->flushing) {
+		if (file.source == source) {
+			file.source = nullptr;
+		}
+	}
+}
+
+static bool CopyRange(int in, int out, off_t offset, off_t len) {
+	loff_t src = offset, dst = offset;
+	while (len > 0) {
+		ssize_t res = copy_file_range(in, &src, out, &dst, len, 0);
+		if (res == -1 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+			char buf[CHUNK_SIZE];
+			res = pread(in, buf, std::min<off_t>(len, sizeof(buf)), src);
+			if (res <= 0 || pwrite(out, buf, res, dst) != res) {
+				return false;
+			}
+			src += res;
+			dst += res;
+		} else if (res <= 0) {
+			return false;
+		}
+
+		len -= res;
+	}
+
+	return true;
+}
+
+// Copies a file on the same host. copy_file_range() lets filesystems that
+// support it share extents instead of copying data, and holes stay holes.
+bool SyncDir::copyFile(fs::path from, fs::path to) {
+	int in = open(from.c_str(), O_RDONLY);
+	struct stat st;
+	if (in == -1 || fstat(in, &st) == -1) {
+		if (in != -1) {
+			close(in);
+		}
+		return false;
+	}
+
+	CreateDirectoryRecursive(to.parent_path().string());
+	StagedFile out(to.parent_path());
+	bool ok = out.fd != -1 && ftruncate(out.fd, st.st_size) != -1;
+	for (off_t offset = 0; ok && offset < st.st_size;) {
+		off_t data = lseek(in, offset, SEEK_DATA);
+		if (data == -1 && errno == ENXIO) {
+			break;
 		}
+		// Without SEEK_DATA support everything counts as data.
+		if (data == -1) {
+			data = offset;
+		}
+
+		off_t end = lseek(in, data, SEEK_HOLE);
+		if (end == -1) {
+			end = st.st_size;
+		}
+		ok = CopyRange(in, out.fd, data, end - data);
+		offset = end;
 	}
-	file.close();
-	updateFilePostHook(filepath, mtime, len, source, buf);
-	delete[] buf;
+
+	close(in);
+	return ok && (this->commit.level == Durability::None || fdatasync(out.fd) != -1) && out.publish(to, this->commit);
 }
 
 void SyncDir::moveFile(std::string oldFilepath, std::string newFilepath, Socket* source) {
+	this->publishPending();
 	fs::rename(this->base / oldFilepath, this->base / newFilepath);
+	this->versions.move(oldFilepath, newFilepath);
+	this->commit.enqueue(-1, (this->base / oldFilepath).parent_path());
+	this->commit.enqueue(-1, (this->base / newFilepath).parent_path());
+	if (oldFilepath == IGNORE_FILE || newFilepath == IGNORE_FILE) {
+		this->reloadIgnore();
+	}
 	std::cout << "Move: " << oldFilepath << " -> " << newFilepath << std::endl;
+	TraceStage(Stage::Apply, currentTrace, newFilepath);
 
 	moveFilePostHook(oldFilepath, newFilepath, source);
 }
 
 void SyncDir::deleteFile(std::string filepath, Socket* source) {
+	this->publishPending();
+	bool isDir = fs::is_directory(this->base / filepath);
 	uintmax_t count = fs::remove_all(this->base / filepath);
+	this->versions.erase(filepath);
+	this->commit.enqueue(-1, (this->base / filepath).parent_path());
+	if (filepath == IGNORE_FILE) {
+		this->reloadIgnore();
+	}
 	std::cout << "Delete: " << filepath << std::endl;
+	TraceStage(Stage::Apply, currentTrace, filepath);
 	
-	deleteFilePostHook(filepath, source, count);
+	deleteFilePostHook(filepath, isDir, source, count);
 }
 
 bool CreateDirectoryRecursive(std::string const &dirName){
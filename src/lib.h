@@ -3,53 +3,230 @@
 #include <filesystem>
 #include <linux/limits.h>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include "ignore.h"
+#include "trace.h"
+#include "transfer.h"
+#include "version.h"
 
 constexpr int MAX_EVENTS = 10;
 constexpr int BUFFER_SIZE = PATH_MAX;
+// A window that collected this many files is flushed right away.
+constexpr size_t GROUP_COMMIT_MAX = 256;
+// From this many files on, one syncfs() is cheaper than fsync() per file.
+constexpr size_t SYNCFS_THRESHOLD = 32;
+constexpr const char* STAGING_PREFIX = ".syncpart.";
 
 namespace fs = std::filesystem;
 
+enum class Durability {
+	// Atomic publish only, flushing is left to the kernel.
+	None,
+	// File data is flushed by the group commit within one window, received
+	// files are published once it is.
+	Batch,
+	// File data is flushed before publish, directory entries by the group commit.
+	Sync,
+};
+
+// Batches fsync()/syncfs() on a background thread, so a burst of small files
+// costs one flush per window instead of one per file. Configured with
+// SYNC_DURABILITY (none, batch, sync) and SYNC_COMMIT_WINDOW_MS.
+class GroupCommit {
+	std::mutex lock;
+	std::condition_variable wake;
+	// Signalled whenever the worker takes or finishes a batch.
+	std::condition_variable progress;
+	std::vector<std::pair<int, fs::path>> pending;
+	// Tickets are handed out in order, those up to flushed are on disk.
+	uint64_t queued;
+	uint64_t flushed;
+	bool stopping;
+	std::thread worker;
+
+	void run();
+	void commit(std::vector<std::pair<int, fs::path>> batch);
+
+public:
+	Durability level;
+	std::chrono::milliseconds window;
+	// An eventfd that turns readable when tickets are done, -1 without a worker.
+	int notify;
+
+	GroupCommit(Durability level, std::chrono::milliseconds window);
+	~GroupCommit();
+	// Takes ownership of fd, which may be -1 when only dir changed, and dir
+	// may be empty when only fd did. Waits while GROUP_COMMIT_MAX entries
+	// are queued, so a slow disk can't use up every descriptor.
+	uint64_t enqueue(int fd, fs::path dir);
+	bool done(uint64_t ticket);
+	void wait(uint64_t ticket);
+	// Resets notify.
+	void drain();
+};
+
+// A file that is written out of sight and then atomically published under
+// its final name. Uses an anonymous O_TMPFILE where the filesystem supports
+// it and a named STAGING_PREFIX file otherwise.
+class StagedFile {
+	fs::path dir;
+	fs::path name;
+
+public:
+	int fd;
+
+	StagedFile(fs::path dir);
+	~StagedFile();
+	bool write(const char* buf, ssize_t len);
+	// Leaves a hole of len bytes.
+	bool skip(ssize_t len);
+	// Renames the file over target, flushing its data is up to the caller.
+	bool publish(fs::path target, GroupCommit& commit);
+};
+
+inline bool IsStagingName(const fs::path& path) {
+	return path.filename().string().starts_with(STAGING_PREFIX);
+}
+
+class Socket;
+
+// A file arriving on a stream, published once its last chunk is in.
+struct Incoming {
+	std::string filepath;
+	ssize_t mtime;
+	ssize_t len;
+	ssize_t received;
+	fs::path target;
+	// Null when the payload is discarded.
+	std::unique_ptr<StagedFile> file;
+	// What the sender offered, what it was weighed against and the result.
+	VersionVector offered;
+	VersionVector base;
+	VersionVector version;
+	uint64_t trace;
+	// Modification time of the local contents a conflict was settled against,
+	// -1 if there was none, so they are only set aside once.
+	ssize_t settled;
+	// Set once the file is complete, the sender is null if it went away.
+	Socket* source;
+	uint64_t ticket;
+};
+
 class Socket {
-	char readBuf[BUFFER_SIZE];
+	char readBuf[CHUNK_SIZE];
 	ssize_t readOffset;
+	uint32_t chunkStream;
+	ssize_t chunkRemaining;
+	// Set by a "t" frame, applies to the command after it.
+	uint64_t trace;
+	Outbox outbox;
+	std::string writeBuf;
+	size_t writeOffset;
+
+	void parse();
 
 public:
 	int fd;
-	
+	// Set when the last readData() ran out of budget before the socket ran dry.
+	bool readBacklog;
+	// Set when the socket is full, cleared again on EPOLLOUT.
+	bool writeBlocked;
+	std::unordered_map<uint32_t, Incoming> incoming;
+
 	Socket(int fd);
 	virtual ~Socket();
 	virtual void handle(std::vector<char>) = 0;
+	virtual void handleChunk(uint32_t stream, const char* buf, ssize_t len) = 0;
 	bool readData();
-	ssize_t readData(char* buf, ssize_t len);
-	bool sendData(const char* buf, ssize_t len);
-	inline bool sendData(std::string buf) {
-		return this->sendData(buf.data(), buf.size());
-	};
+	void send(std::string message, std::vector<std::string> paths = {});
+	void sendFile(std::string filepath, ssize_t mtime, std::string version, fs::path source);
+	void sendFile(std::string filepath, ssize_t mtime, std::string version, std::shared_ptr<const Blob> content);
+	void sendRange(std::string filepath, ssize_t offset, ssize_t len, std::string version, fs::path source);
+	void sendRange(std::string filepath, ssize_t offset, ssize_t len, std::string version, std::shared_ptr<const Blob> content);
+	// Asks the peer to stop sending one of its transfers.
+	void cancelIncoming(uint32_t stream);
+	void cancelOutgoing(uint32_t stream);
+	bool flush();
+
+	inline size_t queued() const {
+		return this->outbox.size();
+	}
+
+	// Whether the event loop should come back to this socket without waiting.
+	inline bool backlog() const {
+		return this->readBacklog || (!this->writeBlocked && (this->writeOffset < this->writeBuf.size() || !this->outbox.empty()));
+	}
 };
 
 class SyncDir {
+	// Received files waiting for the commit, in order, and the last ticket
+	// of each of their paths.
+	std::deque<Incoming> flushing;
+	std::unordered_map<std::string, uint64_t> flushingPaths;
+
+	void publishFile(Incoming& file);
+
 public:
 	fs::path base;
+	GroupCommit commit;
+	IgnoreRules ignore;
+	VersionStore versions;
 
 	SyncDir(fs::path base);
 	
-	void updateFile(std::string filepath, ssize_t mtime, ssize_t len, Socket* source);
+	// Calls f with every regular file in dir and below it that is synced.
+	void walk(fs::path dir, std::function<void(std::string filepath, const fs::directory_entry& entry)> f);
+	void reloadIgnore();
 	[[gnu::noinline]]
-	virtual void updateFileConflictHook(
+	virtual void reloadIgnorePostHook() {}
+
+	// Whether version of filepath should replace the local one, in which case
+	// merged is set to the version the file has afterwards. With settled, a
+	// conflict with local contents of that mtime counts as handled, and it is
+	// set to the mtime of the contents the conflict hook handles.
+	bool supersedes(std::string filepath, ssize_t mtime, ssize_t len, const VersionVector& incoming, Socket* source, VersionVector& merged, ssize_t* settled = nullptr);
+	// Returns whether the payload will be published.
+	bool updateFile(std::string filepath, ssize_t mtime, ssize_t len, uint32_t stream, std::string version, Socket* source);
+	// buf is nullptr for a hole of len bytes.
+	void appendFile(uint32_t stream, const char* buf, ssize_t len, Socket* source);
+	void abortFile(uint32_t stream, Socket* source);
+	void finishFile(Incoming& file, Socket* source);
+	// Publishes received files whose data the commit flushed, in the order
+	// they came in. Called when commit.notify turns readable.
+	void publishFlushed();
+	// Publishes the files still being flushed that an operation on filepath
+	// has to come after, waiting for the commit if needed. All of them when
+	// filepath is empty.
+	void publishPending(std::string filepath = "");
+	// Drops references to a socket that is going away.
+	void detach(Socket* source);
+	// Publishes a copy of from at to, used for conflict copies that can't be
+	// hard links.
+	bool copyFile(fs::path from, fs::path to);
+	// Called for versions concurrent to the local one, returns whether to take it.
+	[[gnu::noinline]]
+	virtual bool updateFileConflictHook(
 		[[maybe_unused]] std::string filepath,
 		[[maybe_unused]] ssize_t mtime,
 		[[maybe_unused]] ssize_t len,
 		[[maybe_unused]] Socket* source
-	) {}
+	) { return false; }
 	[[gnu::noinline]]
 	virtual void updateFilePostHook(
 		[[maybe_unused]] std::string filepath,
 		[[maybe_unused]] ssize_t mtime,
 		[[maybe_unused]] ssize_t len,
-		[[maybe_unused]] Socket* source,
-		[[maybe_unused]] char* buf
+		[[maybe_unused]] Socket* source
 	) {}
 
 	void moveFile(std::string oldFilepath, std::string newFilepath, Socket* source);
@@ -64,6 +241,7 @@ public:
 	[[gnu::noinline]]
 	virtual void deleteFilePostHook(
 	  [[maybe_unused]] std::string filepath,
+	  [[maybe_unused]] bool isDir,
 	  [[maybe_unused]] Socket* source,
 	  [[maybe_unused]] uintmax_t count
 	) {}
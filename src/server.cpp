@@ -1,82 +1,285 @@
 #include <iostream>
+#include <optional>
 #include <sstream>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
 #include <signal.h>
+#include "cache.h"
 #include "lib.h"
 
 int epollFd;
+volatile sig_atomic_t reportStats = 0;
+volatile sig_atomic_t stopping = 0;
+
+// Catching up keeps at most this many operations queued for a client, the
+// rest of the tree is walked as they go out.
+constexpr size_t CATCH_UP_BATCH = 64;
 
 class Client : public Socket {
 public:
-	Client(int fd) : Socket(fd) {
+	// Generation of each file's contents this client was last sent, or
+	// uploaded itself.
+	std::unordered_map<std::string, uint64_t> sent;
+	// Set by "l", the client is only told about large files and fetches them
+	// in ranges once they are opened.
+	bool lazy;
+	// Where catching up with the tree continues, unset once it is done.
+	std::optional<fs::recursive_directory_iterator> cursor;
+
+	Client(int fd) : Socket(fd), lazy(false) {
 	}
 
 	void handle(std::vector<char> buf) override;
+	void handleChunk(uint32_t stream, const char* buf, ssize_t len) override;
 };
 
+static size_t CacheCapacityFromEnv() {
+	const char* env = getenv("SYNC_CACHE_MB");
+	return (size_t) (env ? atoi(env) : 256) << 20;
+}
+
 class Server : public SyncDir {
+	std::vector<Client*> dropped;
+	// Bumped on every publish, so cached contents are never served stale.
+	std::unordered_map<std::string, uint64_t> generations;
+	uint64_t generation;
+
 public:
 	std::vector<Client*> clientSockets;
+	ContentCache cache;
+
+	Server(fs::path base) : SyncDir(base), generation(0), cache(CacheCapacityFromEnv()) {}
+
+	uint64_t generationOf(std::string filepath) {
+		auto [it, _] = this->generations.try_emplace(filepath, 0);
+		if (it->second == 0) {
+			it->second = ++this->generation;
+		}
+		return it->second;
+	}
+
+	void forget(std::string filepath) {
+		std::erase_if(this->generations, [&](auto const& entry) {
+			return PathWithin(entry.first, filepath);
+		});
+		this->cache.erase(filepath);
+	}
 
-	Server(fs::path base) : SyncDir(base) {}
+	void drop(Client* client) {
+		auto it = std::find(this->clientSockets.begin(), this->clientSockets.end(), client);
+		if (it == this->clientSockets.end()) {
+			return;
+		}
+
+		std::cerr << "Client disconnected." << std::endl;
+		this->clientSockets.erase(it);
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, client->fd, nullptr);
+		this->detach(client);
+		// Deleted once nothing in the current pass can refer to it anymore.
+		this->dropped.push_back(client);
+	}
+
+	bool backlog() {
+		return std::any_of(this->clientSockets.begin(), this->clientSockets.end(), [](Client* client) {
+			return client->backlog() || (client->cursor && client->queued() < CATCH_UP_BATCH);
+		});
+	}
+
+	// Gives every client one read and one write budget per pass, so a client
+	// in the middle of a big transfer can't starve the others.
+	void service() {
+		std::vector<Client*> clients = this->clientSockets;
+		for (auto client : clients) {
+			if (std::find(this->dropped.begin(), this->dropped.end(), client) != this->dropped.end()) {
+				continue;
+			}
+			if ((client->readBacklog && !client->readData()) || !client->flush()) {
+				this->drop(client);
+				continue;
+			}
+			if (client->cursor) {
+				this->resume(client);
+			}
+		}
 
-	inline void broadcastExcept(std::string str, Client* except) {
-		this->broadcastExcept(str.data(), str.size(), except);
+		for (auto client : this->dropped) {
+			delete client;
+		}
+		this->dropped.clear();
 	}
 
-	void broadcastExcept(const char* data, ssize_t len, Client* except) {
+	inline void broadcastExcept(std::string str, std::vector<std::string> paths, Client* except) {
+		TraceStage(Stage::Broadcast, currentTrace, paths.empty() ? "" : paths.front());
 		for (const auto client : this->clientSockets) {
-			if (client != except && !(client->sendData(data, len))) {
-				std::cerr << "Failed to send file to client." << std::endl;
-				this->clientSockets.erase(std::remove(this->clientSockets.begin(), this->clientSockets.end(), client), this->clientSockets.end());
-				epoll_ctl(epollFd, EPOLL_CTL_DEL, client->fd, nullptr);
-				delete client;
+			if (client != except) {
+				client->send(str, paths);
 			}
 		}
 	}
 
-	void updateFileConflictHook(std::string filepath, [[maybe_unused]] ssize_t _1, [[maybe_unused]] ssize_t _2, Socket* source) override {
-		source->sendData("eConflict detected on " + filepath + "\n\n");
+	// Files sent once, like those of a catch-up, are streamed from their path
+	// rather than loaded into the cache.
+	void sendCurrent(Client* client, std::string filepath, ssize_t mtime, bool cached = true) {
+		uint64_t generation = this->generationOf(filepath);
+		std::string version = FormatVersion(this->versions.get(filepath));
+		if (client->lazy) {
+			std::error_code ec;
+			uintmax_t size = fs::file_size(this->base / filepath, ec);
+			if (!ec && (ssize_t) size > LAZY_FILE_SIZE) {
+				std::ostringstream oss;
+				oss << "i" << filepath << "\n" << mtime << ' ' << size << ' ' << version << "\n\n";
+				client->send(oss.str(), {filepath});
+				client->sent[filepath] = generation;
+				return;
+			}
+		}
+
+		std::shared_ptr<const Blob> content = cached ? this->cache.get(filepath, generation, this->base / filepath) : nullptr;
+		if (content) {
+			client->sendFile(filepath, mtime, version, content);
+		} else {
+			client->sendFile(filepath, mtime, version, this->base / filepath);
+		}
+		client->sent[filepath] = generation;
+	}
 
-		int fileFd = open((this->base / filepath).c_str(), O_RDONLY);
-		if (fileFd == -1) {
-			std::cerr << "File doesn't exist" << std::endl;
+	void sendRange(Client* client, std::string filepath, ssize_t offset, ssize_t len) {
+		fs::path source = this->base / filepath;
+		if (!fs::exists(source)) {
+			// An empty range of no version, so the client gives up on the file.
+			std::ostringstream oss;
+			oss << "g" << filepath << "\n" << offset << " 0 0 -\n\n";
+			client->send(oss.str(), {filepath});
 			return;
 		}
 
-		char buffer[BUFFER_SIZE];
-		ssize_t bytesRead;
-		while ((bytesRead = read(fileFd, buffer, BUFFER_SIZE)) > 0) {
-			if (source->sendData(buffer, bytesRead)) {
-				std::cerr << "Failed to send file to client." << std::endl;
-				this->clientSockets.erase(std::remove(this->clientSockets.begin(), this->clientSockets.end(), source), this->clientSockets.end());
-				epoll_ctl(epollFd, EPOLL_CTL_DEL, source->fd, nullptr);
-				delete source;
+		std::string version = FormatVersion(this->versions.get(filepath));
+		std::shared_ptr<const Blob> content = this->cache.get(filepath, this->generationOf(filepath), source);
+		if (content) {
+			client->sendRange(filepath, offset, len, version, content);
+		} else {
+			client->sendRange(filepath, offset, len, version, source);
+		}
+	}
+
+	// Brings a lazy client that just connected up to date with the whole tree.
+	void catchUp(Client* client) {
+		std::error_code ec;
+		client->cursor.emplace(this->base, ec);
+		this->resume(client);
+	}
+
+	// Queues the next files of a catch-up until the batch is full.
+	void resume(Client* client) {
+		std::error_code ec;
+		auto& it = *client->cursor;
+		for (; it != fs::recursive_directory_iterator() && client->queued() < CATCH_UP_BATCH; it.increment(ec)) {
+			std::string filepath = it->path().string().substr(this->base.string().length() + 1);
+			bool isDir = it->is_directory();
+			if (IsStagingName(it->path()) || this->ignore.ignored(filepath, isDir)) {
+				if (isDir) {
+					it.disable_recursion_pending();
+				}
+				continue;
+			}
+
+			// Files published since the walk started were already fanned out.
+			if (it->is_regular_file() && client->sent[filepath] != this->generationOf(filepath)) {
+				ssize_t mtime = it->last_write_time().time_since_epoch().count();
+				this->sendCurrent(client, filepath, mtime, false);
 			}
 		}
-	};
+		if (it == fs::recursive_directory_iterator()) {
+			client->cursor.reset();
+		}
+	}
 
-	void updateFilePostHook(std::string filepath, ssize_t mtime, ssize_t len, Socket* source, char* buf) override {
+	void broadcastFileExcept(std::string filepath, ssize_t mtime, Client* except) {
+		TraceStage(Stage::Broadcast, currentTrace, filepath);
+		for (const auto client : this->clientSockets) {
+			if (client != except) {
+				this->sendCurrent(client, filepath, mtime);
+			}
+		}
+	}
+
+	// The server keeps what it has and hands it back to the writer, who sets
+	// its own copy aside and takes the server's version in its place. A writer
+	// that holds that version already only gets the verdict, a lazy one is
+	// told about large files and fetches the ranges it opens.
+	bool updateFileConflictHook(std::string filepath, [[maybe_unused]] ssize_t _1, [[maybe_unused]] ssize_t _2, Socket* source) override {
+		Client* client = (Client*) source;
+		// The sender disconnected while the file was being flushed.
+		if (!client) {
+			return false;
+		}
 		std::ostringstream oss;
-		oss << "u" << filepath << '\n' << mtime << ' ' << len << "\n\n";
-		this->broadcastExcept(oss.str(), (Client*) source);
-		this->broadcastExcept(buf, len, (Client*) source);
+		oss << "x" << filepath << "\n" << FormatVersion(this->versions.get(filepath)) << "\n\n";
+		client->send(oss.str(), {filepath});
+
+		// Fan-out may already have queued the current contents for this client,
+		// or they may be its own earlier upload.
+		if (client->sent[filepath] != this->generationOf(filepath)) {
+			ssize_t mtime = fs::last_write_time(this->base / filepath).time_since_epoch().count();
+			this->sendCurrent(client, filepath, mtime);
+		}
+		return false;
+	};
+
+	void updateFilePostHook(std::string filepath, ssize_t mtime, [[maybe_unused]] ssize_t len, Socket* source) override {
+		this->generations[filepath] = ++this->generation;
+		// What a client uploaded needn't be sent back to it, in a conflict or
+		// a catch-up.
+		if (source) {
+			((Client*) source)->sent[filepath] = this->generation;
+		}
+		if (this->ignore.ignored(filepath, false)) {
+			return;
+		}
+
+		this->broadcastFileExcept(filepath, mtime, (Client*) source);
 	}
 
 	void moveFilePostHook(std::string oldFilepath, std::string newFilepath, Socket* source) override {
+		this->forget(oldFilepath);
+		this->forget(newFilepath);
+
+		bool isDir = fs::is_directory(this->base / newFilepath);
+		bool oldIgnored = this->ignore.ignored(oldFilepath, isDir);
+		bool newIgnored = this->ignore.ignored(newFilepath, isDir);
+
 		std::ostringstream oss;
-		oss << "m" << oldFilepath << "\n" << newFilepath << "\n\n";
-		this->broadcastExcept(oss.str(), (Client *) source);
+		if (oldIgnored && newIgnored) {
+			return;
+		} else if (newIgnored) {
+			oss << "d" << oldFilepath << "\n\n";
+		} else if (oldIgnored) {
+			// The other clients never got the file, so to them it is new, as is
+			// everything in a directory.
+			if (isDir) {
+				this->walk(this->base / newFilepath, [this, source](std::string filepath, const fs::directory_entry& entry) {
+					ssize_t mtime = entry.last_write_time().time_since_epoch().count();
+					this->broadcastFileExcept(filepath, mtime, (Client *) source);
+				});
+			} else {
+				ssize_t mtime = fs::last_write_time(this->base / newFilepath).time_since_epoch().count();
+				this->broadcastFileExcept(newFilepath, mtime, (Client *) source);
+			}
+			return;
+		} else {
+			oss << "m" << oldFilepath << "\n" << newFilepath << "\n\n";
+		}
+		this->broadcastExcept(oss.str(), {oldFilepath, newFilepath}, (Client *) source);
 	}
 
-	void deleteFilePostHook(std::string filepath, Socket* source, uintmax_t count) override {
-		if (count) {
+	void deleteFilePostHook(std::string filepath, bool isDir, Socket* source, uintmax_t count) override {
+		this->forget(filepath);
+		if (count && !this->ignore.ignored(filepath, isDir)) {
 			std::ostringstream oss;
 			oss << "d" << filepath << "\n\n";
-			this->broadcastExcept(oss.str(), (Client*) source);
+			this->broadcastExcept(oss.str(), {filepath}, (Client*) source);
 		}
 	}
 };
@@ -91,11 +294,39 @@ void Client::handle(std::vector<char> buf) {
 		break;
 	case 'u': {
 		std::istringstream iss(rest);
-		std::string filepath;
+		std::string filepath, version;
 		ssize_t len, mtime;
+		uint32_t stream;
 		std::getline(iss, filepath);
-		iss >> mtime >> len;
-		server.updateFile(filepath, mtime, len, this);
+		iss >> mtime >> len >> stream >> version;
+		server.updateFile(filepath, mtime, len, stream, version, this);
+	} break;
+	case 'a':
+		server.abortFile(std::stoul(rest), this);
+		break;
+	case 'k':
+		this->cancelOutgoing(std::stoul(rest));
+		break;
+	case 'l':
+		this->lazy = true;
+		server.catchUp(this);
+		break;
+	case 'r': {
+		std::istringstream iss(rest);
+		std::string filepath;
+		ssize_t offset, len;
+		std::getline(iss, filepath);
+		iss >> offset >> len;
+		if (filepath.size() > 0) {
+			server.sendRange(this, filepath, offset, len);
+		}
+	} break;
+	case 'h': {
+		std::istringstream iss(rest);
+		uint32_t stream;
+		ssize_t len;
+		iss >> stream >> len;
+		server.appendFile(stream, nullptr, len, this);
 	} break;
 	case 'd': {
 		if (rest.size() > 0) {
@@ -117,6 +348,10 @@ void Client::handle(std::vector<char> buf) {
 	}
 }
 
+void Client::handleChunk(uint32_t stream, const char* buf, ssize_t len) {
+	server.appendFile(stream, buf, len, this);
+}
+
 int main(int argc, char *argv[]) {
 	if (argc < 2) {
 		std::cerr << "Correct usage ./server <port>\n";
@@ -175,13 +410,39 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	event.data.ptr = &server.commit;
+	if (server.commit.notify != -1 && epoll_ctl(epollFd, EPOLL_CTL_ADD, server.commit.notify, &event) == -1) {
+		std::cerr << "Failed to add group commit to epoll." << std::endl;
+		close(serverSocket);
+		close(epollFd);
+		return 1;
+	}
+
 	std::vector<epoll_event> events(MAX_EVENTS);
 
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, [](int) { reportStats = 1; });
+	signal(SIGUSR2, [](int) { traceToggle = 1; });
+	// Stopped from the event loop, so the trace is written out.
+	signal(SIGINT, [](int) { stopping = 1; });
+	signal(SIGTERM, [](int) { stopping = 1; });
+	tracer.configure("server");
 
-	while (true) {
-		int numEvents = epoll_wait(epollFd, events.data(), MAX_EVENTS, -1);
+	while (!stopping) {
+		int numEvents = epoll_wait(epollFd, events.data(), MAX_EVENTS, server.backlog() ? 0 : tracer.timeout());
+		tracer.tick();
+		if (reportStats) {
+			reportStats = 0;
+			server.cache.report(std::cout);
+		}
+		if (traceToggle) {
+			traceToggle = 0;
+			tracer.toggle();
+		}
 		if (numEvents == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
 			std::cerr << "Failed to wait for events." << std::endl;
 			close(serverSocket);
 			close(epollFd);
@@ -189,35 +450,53 @@ int main(int argc, char *argv[]) {
 		}
 
 		for (int i = 0; i < numEvents; ++i) {
-			if (events[i].data.fd == serverSocket) {
-				sockaddr_in clientAddress{};
-				socklen_t clientAddressLength = sizeof(clientAddress);
-				int clientSocket = accept(
-					serverSocket,
-					reinterpret_cast<sockaddr*>(&clientAddress),
-					&clientAddressLength
-				);
-				if (clientSocket == -1) {
-					std::cerr << "Failed to accept connection." << std::endl;
-					continue;
-				}
-				fcntl(clientSocket, F_SETFL, O_NONBLOCK);
-
-				event.events = EPOLLIN | EPOLLET;
-				event.data.ptr = new Client(clientSocket);
-				if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) == -1) {
-					std::cerr << "Failed to add client socket to epoll." << std::endl;
-					close(clientSocket);
-					continue;
+			if (events[i].data.ptr == &server.commit) {
+				server.commit.drain();
+				server.publishFlushed();
+			} else if (events[i].data.fd == serverSocket) {
+				// Edge triggered, so take every pending connection at once.
+				while (true) {
+					sockaddr_in clientAddress{};
+					socklen_t clientAddressLength = sizeof(clientAddress);
+					int clientSocket = accept(
+						serverSocket,
+						reinterpret_cast<sockaddr*>(&clientAddress),
+						&clientAddressLength
+					);
+					if (clientSocket == -1) {
+						if (errno != EAGAIN) {
+							std::cerr << "Failed to accept connection." << std::endl;
+						}
+						break;
+					}
+					fcntl(clientSocket, F_SETFL, O_NONBLOCK);
+
+					event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+					event.data.ptr = new Client(clientSocket);
+					if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) == -1) {
+						std::cerr << "Failed to add client socket to epoll." << std::endl;
+						delete (Client*) event.data.ptr;
+						continue;
+					}
+					server.clientSockets.push_back((Client*)event.data.ptr);
+					std::cout << "New client connected." << std::endl;
 				}
-				server.clientSockets.push_back((Client*)event.data.ptr);
-				std::cout << "New client connected." << std::endl;
 			} else {
-				((Client*) events[i].data.ptr)->readData();
+				Client* client = (Client*) events[i].data.ptr;
+				if (events[i].events & EPOLLOUT) {
+					client->writeBlocked = false;
+				}
+				if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !client->readData()) {
+					server.drop(client);
+				}
 			}
 		}
+
+		server.service();
 	}
 
+	server.publishPending();
+	tracer.stop();
 	close(serverSocket);
 	close(epollFd);
 
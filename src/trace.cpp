@@ -0,0 +1,202 @@
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+Tracer tracer;
+uint64_t currentTrace = 0;
+volatile sig_atomic_t traceToggle = 0;
+
+// Just enough of the protobuf wire format for the few fields written here.
+static void PutVarint(std::string& out, uint64_t value) {
+	while (value >= 0x80) {
+		out += (char) (value | 0x80);
+		value >>= 7;
+	}
+	out += (char) value;
+}
+
+static void PutUint(std::string& out, uint32_t field, uint64_t value) {
+	PutVarint(out, field << 3);
+	PutVarint(out, value);
+}
+
+static void PutFixed64(std::string& out, uint32_t field, uint64_t value) {
+	PutVarint(out, field << 3 | 1);
+	for (int i = 0; i < 8; ++i) {
+		out += (char) (value >> (8 * i));
+	}
+}
+
+static void PutBytes(std::string& out, uint32_t field, std::string_view value) {
+	PutVarint(out, field << 3 | 2);
+	PutVarint(out, value.size());
+	out += value;
+}
+
+static int64_t Now() {
+	timespec ts;
+	// Wall clock time, so traces taken on different hosts line up.
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const char* StageName(Stage stage) {
+	switch (stage) {
+	case Stage::Notify: return "notify";
+	case Stage::Queue: return "queue";
+	case Stage::Send: return "send";
+	case Stage::Receive: return "receive";
+	case Stage::Broadcast: return "broadcast";
+	case Stage::Write: return "write";
+	case Stage::Publish: return "publish";
+	case Stage::Apply: return "apply";
+	}
+	return "unknown";
+}
+
+Tracer::Tracer() : fd(-1), pid(0), lastFlush(0), enabled(false) {
+	std::random_device random;
+	this->track = (uint64_t) random() << 32 | random();
+	this->nextId = (uint64_t) random() << 32 | random();
+}
+
+Tracer::~Tracer() {
+	this->stop();
+}
+
+void Tracer::configure(std::string name) {
+	this->name = name;
+	const char* env = getenv("SYNC_TRACE");
+	if (env && *env) {
+		this->start(env);
+	}
+}
+
+bool Tracer::start(std::string path) {
+	this->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (this->fd == -1) {
+		std::cerr << "Failed to open trace \"" << path << "\"." << std::endl;
+		return false;
+	}
+	this->path = path;
+	this->pid = getpid();
+
+	// TracePacket.track_descriptor with a ProcessDescriptor.
+	std::string process, descriptor, packet;
+	PutUint(process, 1, this->pid);
+	PutBytes(process, 6, this->name);
+	PutUint(descriptor, 1, this->track);
+	PutBytes(descriptor, 2, this->name);
+	PutBytes(descriptor, 3, process);
+	PutUint(packet, 10, this->pid);
+	PutBytes(packet, 60, descriptor);
+	PutBytes(this->buffer, 1, packet);
+
+	this->enabled = true;
+	std::cerr << "Tracing to \"" << path << "\"." << std::endl;
+	return true;
+}
+
+void Tracer::stop() {
+	if (this->fd == -1) {
+		return;
+	}
+
+	this->flush();
+	close(this->fd);
+	this->fd = -1;
+	this->enabled = false;
+	std::cerr << "Stopped tracing to \"" << this->path << "\"." << std::endl;
+}
+
+void Tracer::toggle() {
+	if (this->enabled) {
+		this->stop();
+		return;
+	}
+
+	const char* env = getenv("SYNC_TRACE");
+	if (env && *env) {
+		this->start(env);
+	} else {
+		std::ostringstream oss;
+		oss << this->name << "-" << getpid() << ".pftrace";
+		this->start(oss.str());
+	}
+}
+
+uint64_t Tracer::newId() {
+	// Starts at a random point, so ids of different processes don't collide.
+	uint64_t id = this->nextId++;
+	return id == 0 ? this->nextId++ : id;
+}
+
+void Tracer::record(Stage stage, uint64_t id, std::string_view detail) {
+	int64_t now = Now();
+
+	// TrackEvent of type TYPE_INSTANT with a "detail" debug annotation.
+	std::string annotation, event, packet;
+	PutBytes(annotation, 10, "detail");
+	PutBytes(annotation, 6, detail);
+	PutBytes(event, 4, annotation);
+	PutUint(event, 9, 3);
+	PutUint(event, 11, this->track);
+	PutBytes(event, 23, StageName(stage));
+	PutFixed64(event, 47, id);
+	PutUint(packet, 8, now);
+	PutUint(packet, 10, this->pid);
+	PutBytes(packet, 11, event);
+	PutBytes(this->buffer, 1, packet);
+
+	if (this->buffer.size() >= TRACE_BUFFER_SIZE || now - this->lastFlush >= TRACE_FLUSH_MS * 1000000) {
+		this->flush();
+		this->lastFlush = now;
+	}
+}
+
+int Tracer::timeout() const {
+	if (this->fd == -1 || this->buffer.empty()) {
+		return -1;
+	}
+	int64_t left = this->lastFlush + TRACE_FLUSH_MS * 1000000 - Now();
+	// Rounded up, so the flush is due by the time the wait ends.
+	return left <= 0 ? 0 : (int) ((left + 999999) / 1000000);
+}
+
+void Tracer::tick() {
+	if (this->timeout() == 0) {
+		this->flush();
+		this->lastFlush = Now();
+	}
+}
+
+void Tracer::flush() {
+	const char* data = this->buffer.data();
+	size_t len = this->buffer.size();
+	while (len > 0) {
+		ssize_t res = write(this->fd, data, len);
+		if (res == -1 && errno == EINTR) {
+			continue;
+		}
+		if (res == -1) {
+			std::cerr << "Failed to write trace \"" << this->path << "\"." << std::endl;
+			break;
+		}
+		data += res;
+		len -= res;
+	}
+	this->buffer.clear();
+}
+
+std::string TraceFrame(uint64_t id) {
+	std::ostringstream oss;
+	oss << "t" << std::hex << id << "\n\n";
+	return oss.str();
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <csignal>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SYNC_PROBE(s, id, data, size) DTRACE_PROBE4(autosync, stage, s, id, data, size)
+#else
+#define SYNC_PROBE(s, id, data, size) do {} while (0)
+#endif
+
+// Records are buffered and written out once there are this many bytes,
+// or this long after the last write.
+constexpr size_t TRACE_BUFFER_SIZE = 64 * 1024;
+constexpr int64_t TRACE_FLUSH_MS = 1000;
+
+// Points an operation passes on its way from one client to the others.
+enum class Stage : int {
+	// Picked up from inotify.
+	Notify,
+	// Put in the outbox of a connection.
+	Queue,
+	// Its header went out on the wire.
+	Send,
+	// Its header was parsed on the other end.
+	Receive,
+	// Handed to every other client.
+	Broadcast,
+	// Started writing a received file.
+	Write,
+	// Received file published.
+	Publish,
+	// Received move or delete done.
+	Apply,
+};
+
+// Writes stages of traced operations as Perfetto TrackEvent packets, one
+// instant per stage on a track per process, with the trace id as flow id.
+// Traces of several processes can simply be concatenated and opened in the
+// Perfetto UI, which then draws each operation across all of them.
+class Tracer {
+	int fd;
+	int pid;
+	std::string buffer;
+	std::string name;
+	std::string path;
+	uint64_t track;
+	uint64_t nextId;
+	int64_t lastFlush;
+
+	void flush();
+
+public:
+	bool enabled;
+
+	Tracer();
+	~Tracer();
+	// Starts tracing to SYNC_TRACE when it is set.
+	void configure(std::string name);
+	bool start(std::string path);
+	void stop();
+	void toggle();
+	uint64_t newId();
+	void record(Stage stage, uint64_t id, std::string_view detail);
+	// Milliseconds until buffered records are due to be written, -1 when
+	// there are none. Event loops wait no longer than this and then tick.
+	int timeout() const;
+	void tick();
+};
+
+extern Tracer tracer;
+// Trace id of the operation being handled, 0 when it isn't traced.
+extern uint64_t currentTrace;
+// Set from the SIGUSR2 handler, the event loop then toggles tracing.
+extern volatile sig_atomic_t traceToggle;
+
+// Makes id the current trace for as long as it lives.
+class TraceScope {
+	uint64_t saved;
+
+public:
+	TraceScope(uint64_t id) : saved(currentTrace) {
+		currentTrace = id;
+	}
+
+	~TraceScope() {
+		currentTrace = this->saved;
+	}
+};
+
+// Id for a new operation, 0 unless tracing is on.
+inline uint64_t NewTraceId() {
+	return tracer.enabled ? tracer.newId() : 0;
+}
+
+// The probe costs a nop unless a tracer is attached, the record a branch
+// unless tracing is on.
+inline void TraceStage(Stage stage, uint64_t id, std::string_view detail) {
+	SYNC_PROBE((int) stage, id, detail.data(), detail.size());
+	if (id != 0 && tracer.enabled) {
+		tracer.record(stage, id, detail);
+	}
+}
+
+// The frame that tags the next operation on a connection with id.
+std::string TraceFrame(uint64_t id);
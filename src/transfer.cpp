@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "transfer.h"
+
+Blob::~Blob() {
+	if (this->mapping != nullptr) {
+		munmap(this->mapping, this->size);
+	}
+}
+
+Outgoing::~Outgoing() {
+	if (this->fd != -1) {
+		close(this->fd);
+	}
+}
+
+Outbox::Outbox() : nextStream(1) {}
+
+static std::string_view FirstLine(std::string_view message) {
+	return message.substr(0, message.find('\n'));
+}
+
+void Outbox::follow(const std::shared_ptr<Outgoing>& other, const std::shared_ptr<Outgoing>& item) {
+	// Operations on several paths may overlap the same one more than once.
+	if (!other->followers.empty() && other->followers.back() == item) {
+		return;
+	}
+	other->followers.push_back(item);
+	item->blockers++;
+}
+
+void Outbox::unindex(const std::shared_ptr<Outgoing>& item) {
+	for (auto const& path : item->paths) {
+		auto [begin, end] = this->pending.equal_range(path);
+		auto it = std::find_if(begin, end, [&item](auto const& entry) {
+			return entry.second == item;
+		});
+		if (it != end) {
+			this->pending.erase(it);
+		}
+	}
+}
+
+void Outbox::push(std::shared_ptr<Outgoing> item) {
+	// Queued control messages keep their order among themselves and always
+	// go before transfers, so only transfers and blocked operations can be
+	// overtaken and have to be waited for. Those overlapping a path are the
+	// ones on the path itself, below it and on each of its ancestors.
+	for (auto const& path : item->paths) {
+		auto [begin, end] = this->pending.equal_range(path);
+		for (auto it = begin; it != end; ++it) {
+			this->follow(it->second, item);
+		}
+
+		std::string dir = path + "/";
+		for (auto it = this->pending.lower_bound(dir); it != this->pending.end() && it->first.starts_with(dir); ++it) {
+			this->follow(it->second, item);
+		}
+
+		for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+			auto [begin, end] = this->pending.equal_range(path.substr(0, slash));
+			for (auto it = begin; it != end; ++it) {
+				this->follow(it->second, item);
+			}
+		}
+	}
+
+	TraceStage(Stage::Queue, item->trace, item->message.empty() ? item->filepath : FirstLine(item->message));
+	if (item->message.empty() || item->blockers > 0) {
+		for (auto const& path : item->paths) {
+			this->pending.emplace(path, item);
+		}
+	}
+	if (item->blockers == 0) {
+		this->queues[(int) item->priority].push_back(item);
+	}
+}
+
+void Outbox::finish(const std::shared_ptr<Outgoing>& item) {
+	// Control messages were unindexed when they were unblocked.
+	if (item->message.empty()) {
+		this->unindex(item);
+	}
+	if (item->started) {
+		this->streams.erase(item->stream);
+	}
+	for (auto const& follower : item->followers) {
+		if (--follower->blockers == 0) {
+			if (!follower->message.empty()) {
+				this->unindex(follower);
+			}
+			this->queues[(int) follower->priority].push_back(follower);
+		}
+	}
+	item->followers.clear();
+}
+
+void Outbox::cancel(uint32_t stream) {
+	auto it = this->streams.find(stream);
+	if (it == this->streams.end()) {
+		return;
+	}
+
+	std::shared_ptr<Outgoing> item = it->second;
+	auto& queue = this->queues[(int) item->priority];
+	queue.erase(std::remove(queue.begin(), queue.end(), item), queue.end());
+	this->finish(item);
+}
+
+// Finds the next data extent at or after item.offset.
+static void FindExtent(Outgoing& item) {
+	off_t end = item.offset + item.remaining;
+	off_t data = lseek(item.fd, item.offset, SEEK_DATA);
+	if (data == -1) {
+		// ENXIO means only a hole is left, otherwise seeking isn't supported.
+		item.dataStart = errno == ENXIO ? end : item.offset;
+		item.dataEnd = end;
+		return;
+	}
+
+	off_t hole = lseek(item.fd, data, SEEK_HOLE);
+	item.dataStart = std::min(data, end);
+	item.dataEnd = hole == -1 ? end : std::min(hole, end);
+}
+
+bool Outbox::start(Outgoing& item, std::string& frame) {
+	ssize_t size;
+	if (item.content) {
+		size = item.content->size;
+	} else {
+		// Opening a placeholder waits for the client that owns it to answer,
+		// which would be this very thread. It has nothing to send anyway.
+		if (getxattr(item.source.c_str(), PLACEHOLDER_XATTR, nullptr, 0) != -1) {
+			std::cerr << "Failed to send file \"" << item.filepath << "\"." << std::endl;
+			return false;
+		}
+		item.fd = open(item.source.c_str(), O_RDONLY);
+		struct stat st;
+		if (item.fd == -1 || fstat(item.fd, &st) == -1) {
+			std::cerr << "Failed to send file \"" << item.filepath << "\"." << std::endl;
+			return false;
+		}
+		size = st.st_size;
+	}
+
+	if (item.range) {
+		item.offset = std::min(item.offset, size);
+		item.remaining = std::min(item.remaining, size - item.offset);
+	} else {
+		item.remaining = size;
+	}
+	item.dataStart = 0;
+	item.dataEnd = item.content ? size : 0;
+	item.stream = this->nextStream++;
+	item.started = true;
+	if (item.trace != 0) {
+		frame += TraceFrame(item.trace);
+		TraceStage(Stage::Send, item.trace, item.filepath);
+	}
+	std::ostringstream oss;
+	if (item.range) {
+		oss << "g" << item.filepath << '\n' << item.offset << ' ' << item.remaining << ' ' << item.stream << ' ' << item.version << "\n\n";
+	} else {
+		oss << "u" << item.filepath << '\n' << item.mtime << ' ' << item.remaining << ' ' << item.stream << ' ' << item.version << "\n\n";
+	}
+	frame += oss.str();
+	return true;
+}
+
+bool Outbox::next(std::string& frame) {
+	while (true) {
+		auto queue = std::find_if(std::begin(this->queues), std::end(this->queues), [](auto const& queue) {
+			return !queue.empty();
+		});
+		if (queue == std::end(this->queues)) {
+			return false;
+		}
+
+		std::shared_ptr<Outgoing> item = queue->front();
+		queue->pop_front();
+		if (!item->message.empty()) {
+			if (item->trace != 0) {
+				frame += TraceFrame(item->trace);
+				TraceStage(Stage::Send, item->trace, FirstLine(item->message));
+			}
+			frame += item->message;
+			this->finish(item);
+			return true;
+		}
+
+		if (!item->started) {
+			if (!this->start(*item, frame)) {
+				this->finish(item);
+				if (!item->range) {
+					continue;
+				}
+				// An open is held until the range arrives, an empty one of no
+				// version makes the peer give up on it instead.
+				std::ostringstream oss;
+				oss << "g" << item->filepath << '\n' << item->offset << " 0 0 -\n\n";
+				frame += oss.str();
+				return true;
+			}
+			this->streams[item->stream] = item;
+		}
+		if (item->remaining == 0) {
+			this->finish(item);
+			return true;
+		}
+
+		// Holes of sparse files are described instead of sent.
+		if (item->offset >= item->dataEnd) {
+			FindExtent(*item);
+		}
+		if (item->offset < item->dataStart) {
+			ssize_t hole = item->dataStart - item->offset;
+			std::ostringstream oss;
+			oss << "h" << item->stream << ' ' << hole << "\n\n";
+			frame += oss.str();
+
+			item->offset += hole;
+			item->remaining -= hole;
+			if (item->remaining == 0) {
+				this->finish(item);
+			} else {
+				queue->push_back(item);
+			}
+			return true;
+		}
+
+		size_t at = frame.size();
+		ssize_t len = std::min({item->remaining, CHUNK_SIZE, item->dataEnd - item->offset});
+		std::ostringstream oss;
+		oss << "c" << item->stream << ' ' << len << "\n\n";
+		std::string header = oss.str();
+		frame.resize(at + header.size() + len);
+		std::copy(header.begin(), header.end(), frame.begin() + at);
+
+		ssize_t got = 0;
+		if (item->content) {
+			std::copy_n(item->content->data + item->offset, len, frame.begin() + at + header.size());
+			got = len;
+		}
+		while (got < len) {
+			ssize_t res = pread(item->fd, frame.data() + at + header.size() + got, len - got, item->offset + got);
+			if (res == -1 && errno == EINTR) {
+				continue;
+			}
+			if (res <= 0) {
+				break;
+			}
+			got += res;
+		}
+
+		if (got < len) {
+			// The file shrank under us, the next change event sends it again.
+			frame.resize(at);
+			std::ostringstream abort;
+			abort << "a" << item->stream << "\n\n";
+			frame += abort.str();
+			this->finish(item);
+			return true;
+		}
+
+		item->offset += len;
+		item->remaining -= len;
+		if (item->remaining == 0) {
+			this->finish(item);
+		} else {
+			queue->push_back(item);
+		}
+		return true;
+	}
+}
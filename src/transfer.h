@@ -0,0 +1,120 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+// Payloads go out in chunks of at most this size, so other operations can
+// be interleaved with a large transfer.
+constexpr ssize_t CHUNK_SIZE = 64 * 1024;
+// Files up to this size are scheduled ahead of bulk transfers.
+constexpr ssize_t SMALL_FILE_SIZE = 256 * 1024;
+// Bytes a socket may read or write in one go before yielding to the others.
+constexpr ssize_t IO_BUDGET = 256 * 1024;
+// Lazy clients are only told about files larger than this until they open them.
+constexpr ssize_t LAZY_FILE_SIZE = 1024 * 1024;
+// Placeholders are fetched in ranges of this size, this many at a time.
+constexpr ssize_t FETCH_RANGE = 4 * 1024 * 1024;
+constexpr int FETCH_DEPTH = 4;
+// Placeholders carry the version of the server's contents in this attribute,
+// hydrated files in the other one, so both are recognized after a restart.
+constexpr const char* PLACEHOLDER_XATTR = "user.sync.placeholder";
+constexpr const char* HYDRATED_XATTR = "user.sync.hydrated";
+
+// Whether path is dir itself or lies somewhere below it.
+inline bool PathWithin(const std::string& path, const std::string& dir) {
+	return path.starts_with(dir) && (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+enum class Priority {
+	Meta,
+	Small,
+	Bulk,
+};
+
+// File contents held in memory or mapped from a published file, which is
+// never modified in place and so stays valid for as long as it is mapped.
+struct Blob {
+	const char* data = nullptr;
+	size_t size = 0;
+	std::vector<char> owned;
+	void* mapping = nullptr;
+
+	~Blob();
+};
+
+// A queued operation, either a ready control message or a file that is sent
+// as a "u" header followed by "c<stream> <len>" chunk frames. Holes of sparse
+// files go out as "h<stream> <len>" frames without any payload. A range of a
+// file is sent the same way behind a "g" header.
+struct Outgoing {
+	Priority priority = Priority::Meta;
+	std::string message;
+	std::string filepath;
+	ssize_t mtime = 0;
+	std::string version;
+	std::filesystem::path source;
+	// Sent instead of source when set.
+	std::shared_ptr<const Blob> content;
+	// Paths the operation touches, used to keep per-path ordering.
+	std::vector<std::string> paths;
+
+	int fd = -1;
+	ssize_t offset = 0;
+	// Current data extent, found with SEEK_DATA and SEEK_HOLE.
+	ssize_t dataStart = 0;
+	ssize_t dataEnd = 0;
+	uint32_t stream = 0;
+	ssize_t remaining = 0;
+	bool started = false;
+	// Only offset and remaining of the file are sent, in answer to "r".
+	bool range = false;
+	// Sent ahead as a "t" frame when set.
+	uint64_t trace = 0;
+
+	// Operations on overlapping paths that wait for this one to finish.
+	std::vector<std::shared_ptr<Outgoing>> followers;
+	int blockers = 0;
+
+	~Outgoing();
+};
+
+// Multiplexes operations onto one connection. Control messages go first, then
+// small files, then bulk transfers, with chunks of the same class sent round
+// robin. An operation never overtakes an earlier one on an overlapping path.
+class Outbox {
+	std::deque<std::shared_ptr<Outgoing>> queues[3];
+	// Transfers and blocked operations by each of their paths, the ones a
+	// new operation may have to wait for.
+	std::multimap<std::string, std::shared_ptr<Outgoing>> pending;
+	// Started transfers by stream.
+	std::unordered_map<uint32_t, std::shared_ptr<Outgoing>> streams;
+	uint32_t nextStream;
+
+	void follow(const std::shared_ptr<Outgoing>& other, const std::shared_ptr<Outgoing>& item);
+	void unindex(const std::shared_ptr<Outgoing>& item);
+	bool start(Outgoing& item, std::string& frame);
+	void finish(const std::shared_ptr<Outgoing>& item);
+
+public:
+	Outbox();
+	void push(std::shared_ptr<Outgoing> item);
+	// Appends the next frame to frame, returns false when nothing is queued.
+	bool next(std::string& frame);
+	// Drops the rest of a transfer the peer doesn't want.
+	void cancel(uint32_t stream);
+
+	inline bool empty() const {
+		return this->queues[0].empty() && this->queues[1].empty() && this->queues[2].empty();
+	}
+
+	// Operations ready to go, not counting blocked ones.
+	inline size_t size() const {
+		return this->queues[0].size() + this->queues[1].size() + this->queues[2].size();
+	}
+};
@@ -0,0 +1,161 @@
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "version.h"
+
+Order CompareVersions(const VersionVector& a, const VersionVector& b) {
+	bool newer = false, older = false;
+	for (auto const &[replica, count] : a) {
+		auto it = b.find(replica);
+		uint64_t other = it == b.end() ? 0 : it->second;
+		newer = newer || count > other;
+		older = older || count < other;
+	}
+	for (auto const &[replica, count] : b) {
+		older = older || (count > 0 && !a.contains(replica));
+	}
+
+	if (newer && older) {
+		return Order::Concurrent;
+	} else if (newer) {
+		return Order::After;
+	} else if (older) {
+		return Order::Before;
+	}
+	return Order::Equal;
+}
+
+VersionVector MergeVersions(const VersionVector& a, const VersionVector& b) {
+	VersionVector merged = a;
+	for (auto const &[replica, count] : b) {
+		merged[replica] = std::max(merged[replica], count);
+	}
+	return merged;
+}
+
+std::string FormatVersion(const VersionVector& version) {
+	if (version.empty()) {
+		return "-";
+	}
+
+	std::ostringstream oss;
+	for (auto const &[replica, count] : version) {
+		if (oss.tellp() > 0) {
+			oss << ',';
+		}
+		oss << std::hex << replica << ':' << std::dec << count;
+	}
+	return oss.str();
+}
+
+VersionVector ParseVersion(const std::string& text) {
+	VersionVector version;
+	std::istringstream iss(text);
+	std::string entry;
+	while (std::getline(iss, entry, ',')) {
+		size_t colon = entry.find(':');
+		if (colon != std::string::npos) {
+			version[std::stoull(entry.substr(0, colon), nullptr, 16)] = std::stoull(entry.substr(colon + 1));
+		}
+	}
+	return version;
+}
+
+VersionStore::VersionStore(std::string path) : path(path), replica(0) {
+	std::ifstream in(path);
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.starts_with("replica ")) {
+			this->replica = std::stoull(line.substr(8), nullptr, 16);
+			continue;
+		}
+
+		size_t tab = line.find('\t');
+		if (tab == std::string::npos) {
+			continue;
+		}
+		std::string filepath = line.substr(tab + 1);
+		if (line.compare(0, tab, "-") == 0) {
+			this->entries.erase(filepath);
+		} else {
+			this->entries[filepath] = ParseVersion(line.substr(0, tab));
+		}
+	}
+	in.close();
+
+	if (this->replica == 0) {
+		std::random_device random;
+		while (this->replica == 0) {
+			this->replica = (uint64_t) random() << 32 | random();
+		}
+	}
+
+	// Compact the log down to one line per file.
+	std::string compacted = path + ".new";
+	{
+		std::ofstream out(compacted, std::ios::out | std::ios::trunc);
+		out << "replica " << std::hex << this->replica << std::dec << '\n';
+		for (auto const &[filepath, version] : this->entries) {
+			out << FormatVersion(version) << '\t' << filepath << '\n';
+		}
+	}
+	if (rename(compacted.c_str(), path.c_str()) == -1) {
+		std::cerr << "Failed to compact \"" << path << "\"." << std::endl;
+	}
+
+	this->log.open(path, std::ios::out | std::ios::app);
+}
+
+void VersionStore::append(const std::string& filepath, const VersionVector& version) {
+	this->log << FormatVersion(version) << '\t' << filepath << std::endl;
+}
+
+VersionVector VersionStore::get(const std::string& filepath) const {
+	auto it = this->entries.find(filepath);
+	return it == this->entries.end() ? VersionVector() : it->second;
+}
+
+void VersionStore::set(const std::string& filepath, const VersionVector& version) {
+	this->entries[filepath] = version;
+	this->append(filepath, version);
+}
+
+void VersionStore::erase(const std::string& filepath) {
+	if (auto it = this->entries.find(filepath); it != this->entries.end()) {
+		this->append(it->first, {});
+		this->entries.erase(it);
+	}
+
+	std::string dir = filepath + "/";
+	for (auto it = this->entries.lower_bound(dir); it != this->entries.end() && it->first.starts_with(dir);) {
+		this->append(it->first, {});
+		it = this->entries.erase(it);
+	}
+}
+
+void VersionStore::move(const std::string& oldFilepath, const std::string& newFilepath) {
+	std::vector<std::pair<std::string, VersionVector>> moved;
+	if (auto it = this->entries.find(oldFilepath); it != this->entries.end()) {
+		moved.push_back({newFilepath, it->second});
+	}
+
+	std::string dir = oldFilepath + "/";
+	for (auto it = this->entries.lower_bound(dir); it != this->entries.end() && it->first.starts_with(dir); ++it) {
+		moved.push_back({newFilepath + it->first.substr(oldFilepath.size()), it->second});
+	}
+
+	this->erase(oldFilepath);
+	this->erase(newFilepath);
+	for (auto const &[filepath, version] : moved) {
+		this->set(filepath, version);
+	}
+}
+
+VersionVector VersionStore::bump(const std::string& filepath) {
+	VersionVector version = this->get(filepath);
+	version[this->replica]++;
+	this->set(filepath, version);
+	return version;
+}
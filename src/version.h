@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+
+// How many changes each replica made to a file, keyed by replica id.
+using VersionVector = std::map<uint64_t, uint64_t>;
+
+enum class Order {
+	Equal,
+	Before,
+	After,
+	Concurrent,
+};
+
+// Order of a relative to b.
+Order CompareVersions(const VersionVector& a, const VersionVector& b);
+VersionVector MergeVersions(const VersionVector& a, const VersionVector& b);
+// "<replica>:<count>,..." with hex replica ids, "-" when empty.
+std::string FormatVersion(const VersionVector& version);
+VersionVector ParseVersion(const std::string& text);
+
+// Version vectors of every file in a synced directory, kept in an append-only
+// log next to it that is compacted whenever it is loaded.
+class VersionStore {
+	std::string path;
+	// Ordered, so everything below a directory is one range behind "<dir>/".
+	std::map<std::string, VersionVector> entries;
+	std::ofstream log;
+
+	void append(const std::string& filepath, const VersionVector& version);
+
+public:
+	// Id of this replica, generated on first use.
+	uint64_t replica;
+
+	VersionStore(std::string path);
+	VersionVector get(const std::string& filepath) const;
+	void set(const std::string& filepath, const VersionVector& version);
+	// Drops filepath and everything below it.
+	void erase(const std::string& filepath);
+	void move(const std::string& oldFilepath, const std::string& newFilepath);
+	// Counts a local change to filepath and returns its new version.
+	VersionVector bump(const std::string& filepath);
+};